@@ -4,6 +4,7 @@
 #define __MODULE__ "madt"
 
 struct madt_t* madt;
+rwlock_t madt_lock;
 
 struct madt_lapic_t** lapics;
 int lapic_cnt;
@@ -21,10 +22,26 @@ void init_madt() {
     if ((madt = find_sdt("APIC", 0))) {
         TRACE("APIC Configuration:\n");
 
-        lapics = kmalloc(ACPI_MAX_TBL_CNT) + HIGH_VMA;
-        ioapics = kmalloc(ACPI_MAX_TBL_CNT) + HIGH_VMA;
-        isos = kmalloc(ACPI_MAX_TBL_CNT) + HIGH_VMA;
-        nmis = kmalloc(ACPI_MAX_TBL_CNT) + HIGH_VMA;
+        lapics = arena_alloc(boot_arena, ACPI_MAX_TBL_CNT * sizeof(struct madt_lapic_t *));
+        ioapics = arena_alloc(boot_arena, ACPI_MAX_TBL_CNT * sizeof(struct madt_ioapic_t *));
+        isos = arena_alloc(boot_arena, ACPI_MAX_TBL_CNT * sizeof(struct madt_iso_t *));
+        nmis = arena_alloc(boot_arena, ACPI_MAX_TBL_CNT * sizeof(struct madt_nmi_t *));
+
+        if (!lapics || !ioapics || !isos || !nmis) {
+            ERR("Unable to allocate the entry tables\n");
+            lapics = NULL;
+            ioapics = NULL;
+            isos = NULL;
+            nmis = NULL;
+            return;
+        }
+
+        lapics = (struct madt_lapic_t **)((uintptr_t)lapics + HIGH_VMA);
+        ioapics = (struct madt_ioapic_t **)((uintptr_t)ioapics + HIGH_VMA);
+        isos = (struct madt_iso_t **)((uintptr_t)isos + HIGH_VMA);
+        nmis = (struct madt_nmi_t **)((uintptr_t)nmis + HIGH_VMA);
+
+        write_lock(&madt_lock);
 
         for (uint8_t* madt_ptr = (uint8_t *)(&madt->madt_entries_begin);
             (size_t)madt_ptr < (size_t)madt + madt->sdt.len;
@@ -51,5 +68,7 @@ void init_madt() {
                         break;
                 }
             }
+
+        write_release(&madt_lock);
     }
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <alloc.h>
+#include <arena.h>
 #include <trace.h>
 #include <acpi/acpi.h>
 
@@ -34,7 +35,7 @@ struct madt_ioapic_t {
     uint32_t gsi_base;
 } __attribute__((packed));
 
-struct madt_iso {
+struct madt_iso_t {
     struct madt_header_t header;
     uint8_t bus_src;
     uint8_t irq_src;
@@ -42,7 +43,7 @@ struct madt_iso {
     uint16_t flags;
 } __attribute__((packed));
 
-struct madt_nmi {
+struct madt_nmi_t {
     struct madt_header_t header;
     uint8_t acpi_proc_id;
     uint16_t flags;
@@ -51,6 +52,9 @@ struct madt_nmi {
 
 extern struct madt_t* madt;
 
+/* Held for reading around any walk of the arrays below */
+extern rwlock_t madt_lock;
+
 extern struct madt_lapic_t** lapics;
 extern int lapic_cnt;
 
@@ -95,7 +95,7 @@ section .text
 		mov es, ax
 		mov ss, ax
 		mov ax, 0x20
-		mov gs, ax
+		mov gs, ax						; init_percpu sets the base afterwards
 		mov fs, ax
 
 		call kmain
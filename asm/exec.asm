@@ -6,6 +6,12 @@ section .text
 exec_regs:
 	mov rsp, rdi
 
+	; Off the old stack now, whoever waits to run its thread can go
+	test rsi, rsi
+	jz .pop
+	mov DWORD [rsi], 0
+
+.pop:
 	pop r15
 	pop r14
 	pop r13
@@ -24,3 +30,52 @@ exec_regs:
 	add rsp, 16
 
 	iretq
+
+; Saves what a call has to preserve on the old stack, and the stack in
+; *rdi, then resumes a thread that was switched out the same way
+[global switch_to]
+switch_to:
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov [rdi], rsp
+	mov rdi, rsi
+	mov rsi, rdx
+
+[global resume_sp]
+resume_sp:
+	mov rsp, rdi
+
+	test rsi, rsi
+	jz .pop
+	mov DWORD [rsi], 0
+
+.pop:
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+
+	ret
+
+; Like switch_to, but resumes a thread preempted by an interrupt
+[global switch_to_regs]
+switch_to_regs:
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov [rdi], rsp
+	mov rdi, rsi
+	mov rsi, rdx
+
+	jmp exec_regs
@@ -1,17 +1,81 @@
+; LOCKSTAT=1 wraps these in lib/lockstat.c, which takes the plain names
+%ifdef LOCKSTAT
+%define spinlock_lock raw_spinlock_lock
+%define spinlock_release raw_spinlock_release
+%define mcs_lock raw_mcs_lock
+%define mcs_release raw_mcs_release
+%endif
+
+; offsetof(struct percpu_t, preempt), sys/percpu.h checks it matches
+%define PERCPU_PREEMPT 32
+
+; Holding either lock keeps the scheduler off this CPU, see proc/task.c
+%macro preempt_disable 0
+	inc QWORD [gs:PERCPU_PREEMPT]
+%endmacro
+
+%macro preempt_enable 0
+	dec QWORD [gs:PERCPU_PREEMPT]
+%endmacro
+
 global spinlock_lock
 global spinlock_release
+global mcs_lock
+global mcs_release
 
+; rdi = lock. Take a ticket from the low dword, wait for the high one to reach it
 spinlock_lock:
-	lock bts QWORD [rdi], 0
-	jc spin
+	preempt_disable
+	mov eax, 1
+	lock xadd DWORD [rdi], eax
+.spin:
+	cmp DWORD [rdi + 4], eax
+	je .done
+	pause
+	jmp .spin
+.done:
+	ret
+
+; Only the holder writes the serving half, a plain store is a release on x86
+spinlock_release:
+	add DWORD [rdi + 4], 1
+	preempt_enable
 	ret
 
-spin:
+; rdi = lock (tail pointer), rsi = this CPU's node
+mcs_lock:
+	preempt_disable
+	mov QWORD [rsi], 0
+	mov QWORD [rsi + 8], 1
+	mov rax, rsi
+	xchg QWORD [rdi], rax
+	test rax, rax
+	jz .done
+	mov QWORD [rax], rsi
+.spin:
+	cmp QWORD [rsi + 8], 0
+	je .done
 	pause
-	test QWORD [rdi], 1
-	jnz spin
-	jmp spinlock_lock
+	jmp .spin
+.done:
+	ret
 
-spinlock_release:
-	lock btr QWORD [rdi], 0
-	ret
\ No newline at end of file
+; rdi = lock, rsi = node. No successor: swing the tail back to empty,
+; unless someone is halfway through queueing, then wait for their link
+mcs_release:
+	mov rdx, QWORD [rsi]
+	test rdx, rdx
+	jnz .handoff
+	mov rax, rsi
+	lock cmpxchg QWORD [rdi], rdx
+	je .done
+.wait:
+	pause
+	mov rdx, QWORD [rsi]
+	test rdx, rdx
+	jz .wait
+.handoff:
+	mov QWORD [rdx + 8], 0
+.done:
+	preempt_enable
+	ret
@@ -5,6 +5,9 @@
 #define APIC_LEVEL_TRIGGERED    (1 << 3)
 #define APIC_REDIR_BAD_READ     0xFFFFFFFFFFFFFFFF
 
+#define IOAPIC_REG_VER          0x01
+#define IOAPIC_REG_REDIR        0x10
+
 static volatile const uint64_t ia32_apic_base = 0x1b;
 
 
@@ -16,6 +19,82 @@ void x2apic_write(uint16_t offset, uint64_t val) {
 	wrmsr(0x800 + (offset >> 4), val);
 }
 
+uint32_t ioapic_read(uint64_t ioapic_base, uint32_t reg) {
+    volatile uint32_t* ioapic = (volatile uint32_t *)(ioapic_base + HIGH_VMA);
+
+    ioapic[0] = reg;
+    return ioapic[4];
+}
+
+void ioapic_write(uint64_t ioapic_base, uint32_t reg, uint32_t val) {
+    volatile uint32_t* ioapic = (volatile uint32_t *)(ioapic_base + HIGH_VMA);
+
+    ioapic[0] = reg;
+    ioapic[4] = val;
+}
+
+static struct madt_ioapic_t* gsi_to_ioapic(uint32_t gsi) {
+    struct madt_ioapic_t* found = NULL;
+
+    read_lock(&madt_lock);
+
+    for (int i = 0; i < ioapic_cnt; i++) {
+        struct madt_ioapic_t* ioapic = ioapics[i];
+        uint32_t redirs = ((ioapic_read(ioapic->ioapic_addr, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+
+        if (gsi >= ioapic->gsi_base && gsi < ioapic->gsi_base + redirs) {
+            found = ioapic;
+            break;
+        }
+    }
+
+    read_release(&madt_lock);
+    return found;
+}
+
+// flags are MADT ISO flags (polarity in bits 0-1, trigger mode in bits 2-3)
+uint32_t redirect_gsi(uint32_t gsi, uint64_t ap, uint8_t irq, uint64_t flags) {
+    struct madt_ioapic_t* ioapic = gsi_to_ioapic(gsi);
+
+    if (!ioapic)
+        return 0;
+
+    uint64_t redir = irq;
+
+    if (flags & APIC_ACTIVE_HIGH)
+        redir |= (1 << 13);     // active low
+
+    if (flags & APIC_LEVEL_TRIGGERED)
+        redir |= (1 << 15);     // level triggered
+
+    redir |= ap << 56;
+
+    uint32_t reg = IOAPIC_REG_REDIR + (gsi - ioapic->gsi_base) * 2;
+    ioapic_write(ioapic->ioapic_addr, reg, (uint32_t)redir);
+    ioapic_write(ioapic->ioapic_addr, reg + 1, (uint32_t)(redir >> 32));
+
+    return 1;
+}
+
+uint32_t redirect_irq(uint8_t irq, uint64_t ap, uint8_t vector) {
+    uint32_t gsi = irq;
+    uint64_t flags = 0;
+
+    // Dropped before redirect_gsi, which takes it again
+    read_lock(&madt_lock);
+
+    for (int i = 0; i < iso_cnt; i++) {
+        if (isos[i]->irq_src == irq) {
+            gsi = isos[i]->gsi;
+            flags = isos[i]->flags;
+            break;
+        }
+    }
+
+    read_release(&madt_lock);
+    return redirect_gsi(gsi, ap, vector, flags);
+}
+
 static void set_lapic_timer_mask(size_t mask) {
     uint32_t entry = x2apic_read(LAPIC_REG_LVT_TIMER);
     if(mask) {
@@ -27,26 +106,48 @@ static void set_lapic_timer_mask(size_t mask) {
     x2apic_write(LAPIC_REG_LVT_TIMER, entry);
 }
 
-void init_lapic_timer() {
+static size_t lapic_ticks_per_ms;
+
+// A tick a millisecond on vector 32, APs start theirs with the BSP's calibration
+void lapic_timer_start() {
+    uint32_t entry = x2apic_read(LAPIC_REG_LVT_TIMER);
+    entry &= ~(3 << 17);
+    entry |= (1 << 17);
+    entry = ((entry & 0xFFFFFF00) | 32);
+
+    x2apic_write(LAPIC_REG_LVT_TIMER, entry);
     x2apic_write(LAPIC_REG_TIMER_DIVCONF, 0x3);
-    x2apic_write(LAPIC_REG_TIMER_INITCNT, 0xFFFFFFFF);
+    x2apic_write(LAPIC_REG_TIMER_INITCNT, lapic_ticks_per_ms);
+
     set_lapic_timer_mask(0);
-    hpet_poll_and_sleep(10);
-    set_lapic_timer_mask(1);
+}
 
-    size_t num_ticks = x2apic_read(LAPIC_REG_TIMER_CURCNT);
-    size_t ticks_p_ms = (0xFFFFFFFF - num_ticks) / 10;
+// A single interrupt on vector 32 after ms, the periodic tick stops until lapic_timer_start
+void lapic_timer_oneshot(size_t ms) {
+    uint64_t count = ms * lapic_ticks_per_ms;
 
     uint32_t entry = x2apic_read(LAPIC_REG_LVT_TIMER);
     entry &= ~(3 << 17);
-    entry |= (1 << 17);
     entry = ((entry & 0xFFFFFF00) | 32);
 
     x2apic_write(LAPIC_REG_LVT_TIMER, entry);
     x2apic_write(LAPIC_REG_TIMER_DIVCONF, 0x3);
-    x2apic_write(LAPIC_REG_TIMER_INITCNT, ticks_p_ms);
+    x2apic_write(LAPIC_REG_TIMER_INITCNT, count < 0xFFFFFFFF ? count : 0xFFFFFFFF);
 
     set_lapic_timer_mask(0);
+}
+
+void init_lapic_timer() {
+    x2apic_write(LAPIC_REG_TIMER_DIVCONF, 0x3);
+    x2apic_write(LAPIC_REG_TIMER_INITCNT, 0xFFFFFFFF);
+    set_lapic_timer_mask(0);
+    hpet_poll_and_sleep(10);
+    set_lapic_timer_mask(1);
+
+    size_t num_ticks = x2apic_read(LAPIC_REG_TIMER_CURCNT);
+    lapic_ticks_per_ms = (0xFFFFFFFF - num_ticks) / 10;
+
+    lapic_timer_start();
     TRACE("Timer Initialized\n", num_ticks);
 }
 
@@ -70,8 +70,12 @@ uint32_t ioapic_read(uint64_t ioapic_base, uint32_t reg);
 void ioapic_write(uint64_t ioapic_base, uint32_t reg, uint32_t val);
 
 uint32_t redirect_gsi(uint32_t gsi, uint64_t ap, uint8_t irq, uint64_t flags);
+uint32_t redirect_irq(uint8_t irq, uint64_t ap, uint8_t vector);
 
+void lapic_timer_start();
+void lapic_timer_oneshot(size_t ms);
 void init_lapic_timer();
+void x2apic_enable();
 void init_apic();
 
 uint64_t x2apic_read(uint16_t offset);
@@ -1,4 +1,8 @@
 #include <drivers/pci.h>
+#include <trace.h>
+
+#undef __MODULE__
+#define __MODULE__ "pci"
 
 struct pci_cfg_desc_t {
     uint64_t base;
@@ -16,7 +20,9 @@ struct acpi_mcfg_t {
 } __attribute__((packed));
 
 static struct vector_t* devices;
+static rwlock_t devices_lock;
 static struct vector_t* handlers;
+static struct kmem_cache_t* pci_dev_cache;
 
 static uint16_t pci_cfg_desc_cnt;
 static struct pci_cfg_desc_t* cfg_descs;
@@ -182,6 +188,27 @@ static char* get_dev_type(uint8_t class, uint8_t subclass, uint8_t prog_if) {
     }
 }
 
+struct pci_dev_t* pci_find(struct pci_id_t* id, size_t n) {
+    struct pci_dev_t* found = NULL;
+
+    // Walks the items directly, vec_g would serialise readers on the vector's spinlock
+    read_lock(&devices_lock);
+
+    for (size_t i = 0; i < devices->n; i++) {
+        struct pci_dev_t* device = devices->items[i];
+        uint32_t class = device->cfg_space[2];
+
+        if ((class >> 24) == id->class && ((class >> 16) & 0xFF) == id->subclass &&
+            ((class >> 8) & 0xFF) == id->prog_if && !n--) {
+            found = device;
+            break;
+        }
+    }
+
+    read_release(&devices_lock);
+    return found;
+}
+
 static uint32_t* pci_cfg_space(uint16_t bus, uint16_t dev, uint16_t func) {
     for (int i = 0; i < pci_cfg_desc_cnt; i++) {
         struct pci_cfg_desc_t* cfg = &cfg_descs[i];
@@ -209,12 +236,21 @@ static void pci_enumerate() {
                     
                 uint16_t c_sub = cfg_space[2] >> 16;
 
-                struct pci_dev_t* device = kmalloc(sizeof(struct pci_dev_t));
+                struct pci_dev_t* device = kmem_cache_alloc(pci_dev_cache);
+
+                if (!device) {
+                    ERR("Out of memory, enumeration stops at %x:%x.%x\n", bus, dev, func);
+                    return;
+                }
+
                 device->bus = bus;
                 device->device = dev;
                 device->function = func;
                 device->cfg_space = cfg_space;
+
+                write_lock(&devices_lock);
                 vec_a(devices, device);
+                write_release(&devices_lock);
 
                 switch (c_sub) {
                     case 0x0106:
@@ -227,8 +263,18 @@ static void pci_enumerate() {
 }
 
 void init_pci() {
-    devices = kmalloc(sizeof(struct vector_t)) + HIGH_VMA;
-    handlers = kmalloc(sizeof(struct vector_t)) + HIGH_VMA;
+    pci_dev_cache = kmem_cache_create("pci_dev_t", sizeof(struct pci_dev_t), 0, NULL);
+
+    devices = arena_alloc(boot_arena, sizeof(struct vector_t));
+    handlers = arena_alloc(boot_arena, sizeof(struct vector_t));
+
+    if (!pci_dev_cache || !devices || !handlers) {
+        ERR("Unable to allocate the device tables\n");
+        return;
+    }
+
+    devices = (struct vector_t *)((uintptr_t)devices + HIGH_VMA);
+    handlers = (struct vector_t *)((uintptr_t)handlers + HIGH_VMA);
     vec_n(devices);
 
     struct acpi_mcfg_t* mcfg = find_sdt("MCFG", 0);
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <alloc.h>
+#include <arena.h>
+#include <slab.h>
 #include <locks.h>
 #include <mem.h>
 #include <io.h>
@@ -28,6 +30,9 @@ struct pci_dev_t {
 uint32_t pci_pio_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t reg);
 void pci_pio_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t reg, uint32_t data);
 
+/* The nth device (from 0) matching id, or NULL */
+struct pci_dev_t* pci_find(struct pci_id_t* id, size_t n);
+
 void init_pci();
 
 #endif
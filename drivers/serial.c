@@ -1,7 +1,21 @@
 #include <drivers/serial.h>
+#include <drivers/apic.h>
+#include <sys/interrupts.h>
+#include <io.h>
 
 spinlock_t serial_lock;
 
+struct serial_cmd_t {
+    char* name;
+    void (*handler)(char* args);
+};
+
+static struct serial_cmd_t serial_cmds[SERIAL_MAX_CMDS];
+static size_t serial_cmd_cnt;
+
+static char serial_line[SERIAL_LINE_SIZE];
+static size_t serial_line_len;
+
 void init_serial() {
   outb(PORT + 1, 0x00); // Disable all interrupts
   outb(PORT + 3, 0x80); // Enable DLAB (set baud rate divisor)
@@ -37,3 +51,92 @@ void serial_print_int(int num) {
     itoa(num, toprint);
     serial_print(toprint);
 }
+
+int serial_register_cmd(char* name, void (*handler)(char* args)) {
+    if (serial_cmd_cnt == SERIAL_MAX_CMDS)
+        return 0;
+
+    serial_cmds[serial_cmd_cnt].name = name;
+    serial_cmds[serial_cmd_cnt].handler = handler;
+    serial_cmd_cnt++;
+
+    return 1;
+}
+
+static void serial_run_cmd(char* line) {
+    while (*line == ' ')
+        line++;
+
+    if (!*line)
+        return;
+
+    char* args = line;
+    while (*args && *args != ' ')
+        args++;
+
+    if (*args)
+        *args++ = '\0';
+
+    while (*args == ' ')
+        args++;
+
+    for (size_t i = 0; i < serial_cmd_cnt; i++) {
+        if (!strcmp(serial_cmds[i].name, line)) {
+            serial_cmds[i].handler(args);
+            return;
+        }
+    }
+
+    printf("%s: unknown command, try 'help'\n", line);
+}
+
+static void serial_handler(struct regs_t* regs) {
+    (void)regs;
+
+    while (inb(PORT + 5) & 0x01) {
+        char c = inb(PORT);
+
+        if (c == '\r' || c == '\n') {
+            serial_write('\r');
+            serial_write('\n');
+
+            serial_line[serial_line_len] = '\0';
+            serial_line_len = 0;
+            serial_run_cmd(serial_line);
+        } else if (c == '\b' || c == 0x7F) {
+            if (serial_line_len) {
+                serial_line_len--;
+                serial_write('\b');
+                serial_write(' ');
+                serial_write('\b');
+            }
+        } else if (serial_line_len < SERIAL_LINE_SIZE - 1) {
+            serial_line[serial_line_len++] = c;
+            serial_write(c);
+        }
+    }
+}
+
+static void serial_help(char* args) {
+    (void)args;
+
+    for (size_t i = 0; i < serial_cmd_cnt; i++)
+        printf("%s\n", serial_cmds[i].name);
+}
+
+void init_serial_console() {
+    #undef __MODULE__
+    #define __MODULE__ "com1"
+
+    serial_register_cmd("help", serial_help);
+
+    register_handler(SERIAL_VECTOR, serial_handler);
+    if (!redirect_irq(SERIAL_IRQ, x2apic_read(LAPIC_REG_ID), SERIAL_VECTOR)) {
+        WARN("No IOAPIC serves IRQ %d, console disabled\n", SERIAL_IRQ);
+        return;
+    }
+
+    outb(PORT + 1, 0x01); // Interrupt on received data
+
+    TRACE("Console on vector %d\n", SERIAL_VECTOR);
+}
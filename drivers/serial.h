@@ -7,10 +7,19 @@
 
 #define PORT 0x3F8 /* COM1 */
 
+#define SERIAL_IRQ          4
+#define SERIAL_VECTOR       36
+
+#define SERIAL_MAX_CMDS     16
+#define SERIAL_LINE_SIZE    128
+
 void serial_write(char a);
 void serial_print(char* message);
 void serial_print_int(int num);
 
+int serial_register_cmd(char* name, void (*handler)(char* args));
+
 void init_serial();
+void init_serial_console();
 
 #endif
@@ -1,21 +1,27 @@
 #include <fs/fd.h>
 
 static struct vector_t* fds;
+static struct kmem_cache_t* fd_cache;
 
 size_t fd_open(struct vfs_node_t* target, size_t mode) {
     if (!target)
         return 0;
 
-    spinlock_lock(&fds->lock);
+    struct fd_t* ret = kmem_cache_alloc(fd_cache);
+
+    if (!ret)
+        return 0;
 
-    struct fd_t* ret = kmalloc(sizeof(struct fd_t)) + HIGH_VMA;
+    ret = (struct fd_t *)((uintptr_t)ret + HIGH_VMA);
     ret->node = target;
     ret->mode = mode;
     ret->seek = 0;
 
-    vec_a(fds, ret);
-
-    spinlock_release(&fds->lock);
+    // vec_a takes fds->lock itself
+    if (!vec_a(fds, ret)) {
+        kmem_cache_free(fd_cache, ret);
+        return 0;
+    }
 
     return 0;
 }
@@ -26,6 +32,7 @@ size_t fd_close(size_t fd) {
 
     spinlock_lock(&fds->lock);
 
+    kmem_cache_free(fd_cache, fds->items[fd]);
     fds->items[fd] = NULL;
 
     spinlock_release(&fds->lock);
@@ -42,6 +49,8 @@ size_t fd_seek(size_t fd, size_t pos) {
 }
 
 void init_fds() {
+    fd_cache = kmem_cache_create("fd_t", sizeof(struct fd_t), 0, NULL);
+
     fds = kmalloc(sizeof(struct vector_t)) + HIGH_VMA;
     vec_n(fds);
 }
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <alloc.h>
+#include <slab.h>
 #include <mem.h>
 #include <locks.h>
 #include <vec.h>
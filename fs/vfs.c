@@ -1,10 +1,128 @@
 #include <fs/vfs.h>
 
+#undef __MODULE__
+#define __MODULE__ "vfs"
+
 static struct vfs_node_t* root;
+static struct kmem_cache_t* vfs_node_cache;
 
-static spinlock_t vfs_lock;
+/*
+ * Lookups run on every CPU at once under vfs_lock. Updates serialise on
+ * vfs_update_lock, which they will hold across disk I/O, and only take
+ * vfs_lock to link the finished node in.
+ */
+static percpu_rwlock_t vfs_lock;
+static struct mutex_t vfs_update_lock;
 static struct bitmap_t* uuid_bitmap;
 
+static struct vfs_node_t* vfs_child(struct vfs_node_t* node, const char* name, size_t len) {
+    if (!node->children)
+        return NULL;
+
+    for (size_t i = 0; i < node->children->n; i++) {
+        struct vfs_node_t* child = node->children->items[i];
+
+        if (!strncmp(child->name, name, len) && !child->name[len])
+            return child;
+    }
+
+    return NULL;
+}
+
+// Caller holds vfs_lock, for reading at least
+static struct vfs_node_t* vfs_walk(const char* path) {
+    struct vfs_node_t* node = root;
+
+    while (node && *path) {
+        while (*path == '/')
+            path++;
+
+        size_t len = 0;
+        while (path[len] && path[len] != '/')
+            len++;
+
+        if (!len)
+            break;
+
+        node = vfs_child(node, path, len);
+        path += len;
+    }
+
+    return node;
+}
+
+struct vfs_node_t* vfs_lookup(char* path) {
+    percpu_read_lock(&vfs_lock);
+    struct vfs_node_t* node = vfs_walk(path);
+    percpu_read_release(&vfs_lock);
+
+    return node;
+}
+
+size_t create(char* path, char* filename, size_t permissions) {
+    struct vfs_node_t* node = kmem_cache_alloc(vfs_node_cache);
+
+    if (!node)
+        return 0;
+
+    node = (struct vfs_node_t *)((uintptr_t)node + HIGH_VMA);
+    memset(node, 0, sizeof(struct vfs_node_t));
+
+    node->name = kmalloc(strlen(filename) + 1);
+
+    if (!node->name) {
+        kmem_cache_free(vfs_node_cache, node);
+        return 0;
+    }
+
+    strcpy(node->name, filename);
+    node->permissions = permissions;
+    node->open = open;
+    node->close = close;
+    node->read = read;
+    node->write = write;
+    node->seek = seek;
+
+    mutex_lock(&vfs_update_lock);
+
+    // Only updaters change the tree, holding the mutex keeps it still
+    struct vfs_node_t* parent = vfs_walk(path);
+
+    if (!parent || vfs_child(parent, filename, strlen(filename)))
+        goto fail;
+
+    struct vector_t* children = parent->children;
+
+    if (!children) {
+        children = kmalloc(sizeof(struct vector_t));
+
+        if (!vec_n(children))
+            goto fail;
+    }
+
+    node->uuid = bitmap_a(uuid_bitmap, 1);
+    node->parent = parent;
+
+    percpu_write_lock(&vfs_lock);
+
+    parent->children = children;
+    int linked = vec_a(children, node);
+
+    percpu_write_release(&vfs_lock);
+
+    if (!linked)
+        goto fail;
+
+    mutex_unlock(&vfs_update_lock);
+    return 1;
+
+fail:
+    mutex_unlock(&vfs_update_lock);
+    kfree(node->name);
+    kmem_cache_free(vfs_node_cache, node);
+    return 0;
+}
+
 size_t open(char* path, size_t mode) {
     ;
 }
@@ -26,18 +144,41 @@ size_t seek(size_t fd, size_t n) {
 }
 
 void init_vfs() {
-    root = kmalloc(sizeof(struct vfs_node_t)) + HIGH_VMA;
-    root->name = kmalloc(1);
-    uuid_bitmap = kmalloc(sizeof(struct vfs_node_t)) + HIGH_VMA;
+    vfs_node_cache = kmem_cache_create("vfs_node_t", sizeof(struct vfs_node_t), CACHE_LINE_SIZE, NULL);
+
+    root = kmem_cache_alloc(vfs_node_cache);
+
+    if (!root) {
+        ERR("Unable to allocate the root node\n");
+        return;
+    }
+
+    root = (struct vfs_node_t *)((uintptr_t)root + HIGH_VMA);
+    memset(root, 0, sizeof(struct vfs_node_t));
+
+    root->name = arena_alloc(boot_arena, 2);
+    uuid_bitmap = arena_alloc(boot_arena, sizeof(struct bitmap_t));
+
+    if (!root->name || !uuid_bitmap) {
+        ERR("Unable to allocate the root node\n");
+        return;
+    }
+
+    root->name = (char *)((uintptr_t)root->name + HIGH_VMA);
+    uuid_bitmap = (struct bitmap_t *)((uintptr_t)uuid_bitmap + HIGH_VMA);
     
     bitmap_n(uuid_bitmap, 1);
     
     root->uuid = bitmap_a(uuid_bitmap, 1);
-    strncpy(root->name, "/", 1);
+    strcpy(root->name, "/");
 
     root->open = open;
     root->close = close;
     root->read = read;
     root->write = write;
     root->seek = seek;
+
+    root->permissions = 0;
+    root->parent = NULL;
+    root->children = NULL;
 }
@@ -4,10 +4,14 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <alloc.h>
+#include <slab.h>
+#include <arena.h>
 #include <bitmap.h>
 #include <mem.h>
 #include <vec.h>
 #include <str.h>
+#include <rwlock.h>
+#include <proc/mutex.h>
 
 #define F_READ  0x1
 #define F_WRITE 0x2
@@ -25,11 +29,12 @@ struct vfs_node_t {
 
     size_t permissions;
 
-    struct vfs_node* parent;
+    struct vfs_node_t* parent;
     struct vector_t* children;
 };
 
 size_t create(char* path, char* filename, size_t permissions);
+struct vfs_node_t* vfs_lookup(char* path);
 
 size_t open(char* path, size_t mode);
 size_t close(size_t fd);
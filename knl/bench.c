@@ -0,0 +1,594 @@
+#include <knl/bench.h>
+#include <alloc.h>
+#include <locks.h>
+#include <rwlock.h>
+#include <rcu.h>
+#include <proc/task.h>
+#include <proc/wait.h>
+#include <sys/smp.h>
+#include <sys/interrupts.h>
+#include <sys/msrs.h>
+#include <drivers/hpet.h>
+
+#define BENCH_KMALLOC_ROUNDS    4096
+#define BENCH_KMALLOC_BATCH     64
+
+#define BENCH_LOCK_ROUNDS       100000
+#define BENCH_LOCK_WORK         8
+
+#define BENCH_READ_ROUNDS       1000000
+
+#define BENCH_FAIR_MS           2000
+#define BENCH_FAIR_THREADS      4
+
+#define BENCH_SCHED_MS          1000
+
+#define BENCH_SWITCH_ROUNDS     100000
+
+#define BENCH_WAKE_ROUNDS       20000
+
+static uint64_t tsc_per_ms;
+
+static volatile size_t bench_ready;
+static volatile size_t bench_go;
+
+struct bench_kmalloc_arg_t {
+    size_t size;
+    uint64_t cycles[SMP_MAX_CPUS];
+};
+
+struct bench_lock_t {
+    const char* name;
+    void (*lock)(struct mcs_node_t* node);
+    void (*release)(struct mcs_node_t* node);
+};
+
+struct bench_lock_arg_t {
+    const struct bench_lock_t* lock;
+    uint64_t cycles[SMP_MAX_CPUS];
+};
+
+struct bench_read_t {
+    const char* name;
+    size_t (*read)();
+};
+
+struct bench_read_arg_t {
+    const struct bench_read_t* read;
+    uint64_t cycles[SMP_MAX_CPUS];
+};
+
+struct bench_fair_arg_t {
+    int nice;
+    uint64_t loops;
+};
+
+struct bench_switch_arg_t {
+    int irq;
+    uint64_t cycles;
+};
+
+struct bench_sched_arg_t {
+    uint64_t yields;
+} __attribute__((aligned(64)));
+
+static spinlock_t bench_ttas;
+static spinlock_t bench_ticket;
+static mcs_lock_t bench_mcs;
+
+// What the locks protect, on a line of its own
+static volatile size_t bench_shared[8] __attribute__((aligned(64)));
+
+static rwlock_t bench_rwlock;
+static percpu_rwlock_t bench_percpu_rwlock;
+
+// A read-mostly table entry, read through each kind of lock
+static size_t bench_table[8] __attribute__((aligned(64)));
+static size_t* bench_entry = bench_table;
+
+// Spinners stop here and count down, the idle loop gets the CPU back once they all have
+static volatile uint64_t bench_fair_end;
+static volatile size_t bench_fair_left;
+
+// Yielders count between the two, they are all queued by the time the first one starts
+static volatile uint64_t bench_sched_start;
+static volatile uint64_t bench_sched_end;
+static volatile size_t bench_sched_left;
+
+static volatile size_t bench_switch_left;
+
+// Whose turn it is, the two threads take it in turns and sleep in between
+static struct wait_queue_t bench_wake_wq[2];
+static volatile size_t bench_wake_turn;
+static volatile size_t bench_wake_left;
+static uint64_t bench_wake_cycles;
+
+static void bench_calibrate() {
+    uint64_t start = rdtsc();
+    hpet_poll_and_sleep(10);
+    tsc_per_ms = (rdtsc() - start) / 10;
+}
+
+// Line every CPU up so they all start hammering the allocator at once
+static void bench_barrier() {
+    size_t go = bench_go;
+
+    if (__atomic_add_fetch(&bench_ready, 1, __ATOMIC_ACQ_REL) == smp_cpu_count) {
+        bench_ready = 0;
+        __atomic_store_n(&bench_go, go + 1, __ATOMIC_RELEASE);
+    } else {
+        while (__atomic_load_n(&bench_go, __ATOMIC_ACQUIRE) == go)
+            asm volatile("pause");
+    }
+}
+
+static void bench_kmalloc_cpu(void* data) {
+    struct bench_kmalloc_arg_t* arg = data;
+    void* objs[BENCH_KMALLOC_BATCH];
+
+    bench_barrier();
+
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < BENCH_KMALLOC_ROUNDS; i++) {
+        for (size_t j = 0; j < BENCH_KMALLOC_BATCH; j++)
+            objs[j] = kmalloc(arg->size);
+
+        for (size_t j = 0; j < BENCH_KMALLOC_BATCH; j++)
+            kfree(objs[j]);
+    }
+
+    arg->cycles[smp_cpu_id()] = rdtsc() - start;
+}
+
+// The test-and-test-and-set lock spinlock_t used to be, for comparison
+static void bench_ttas_lock(struct mcs_node_t* node) {
+    (void)node;
+
+    while (__atomic_exchange_n(&bench_ttas, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&bench_ttas, __ATOMIC_RELAXED))
+            asm volatile("pause");
+    }
+}
+
+static void bench_ttas_release(struct mcs_node_t* node) {
+    (void)node;
+    __atomic_store_n(&bench_ttas, 0, __ATOMIC_RELEASE);
+}
+
+static void bench_ticket_lock(struct mcs_node_t* node) {
+    (void)node;
+    spinlock_lock(&bench_ticket);
+}
+
+static void bench_ticket_release(struct mcs_node_t* node) {
+    (void)node;
+    spinlock_release(&bench_ticket);
+}
+
+static void bench_mcs_lock(struct mcs_node_t* node) {
+    mcs_lock(&bench_mcs, node);
+}
+
+static void bench_mcs_release(struct mcs_node_t* node) {
+    mcs_release(&bench_mcs, node);
+}
+
+static void bench_lock_cpu(void* data) {
+    struct bench_lock_arg_t* arg = data;
+    struct mcs_node_t node;
+
+    bench_barrier();
+
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < BENCH_LOCK_ROUNDS; i++) {
+        arg->lock->lock(&node);
+
+        for (size_t j = 0; j < sizeof(bench_shared) / sizeof(bench_shared[0]); j++)
+            bench_shared[j]++;
+
+        arg->lock->release(&node);
+
+        // Some time away from the lock, or it's nothing but hand-offs
+        for (volatile size_t j = 0; j < BENCH_LOCK_WORK; j++)
+            ;
+    }
+
+    arg->cycles[smp_cpu_id()] = rdtsc() - start;
+}
+
+static size_t bench_read_rwlock() {
+    read_lock(&bench_rwlock);
+    size_t v = bench_entry[0];
+    read_release(&bench_rwlock);
+
+    return v;
+}
+
+static size_t bench_read_percpu() {
+    percpu_read_lock(&bench_percpu_rwlock);
+    size_t v = bench_entry[0];
+    percpu_read_release(&bench_percpu_rwlock);
+
+    return v;
+}
+
+static size_t bench_read_rcu() {
+    rcu_read_lock();
+    size_t v = rcu_dereference(bench_entry)[0];
+    rcu_read_unlock();
+
+    return v;
+}
+
+static void bench_read_cpu(void* data) {
+    struct bench_read_arg_t* arg = data;
+    size_t sum = 0;
+
+    bench_barrier();
+
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < BENCH_READ_ROUNDS; i++)
+        sum += arg->read->read();
+
+    arg->cycles[smp_cpu_id()] = rdtsc() - start;
+    bench_shared[0] += sum;
+}
+
+// Loops only go round while the thread has the CPU, so they count its share of it
+static void bench_fair_thread(void* data) {
+    struct bench_fair_arg_t* arg = data;
+    uint64_t loops = 0;
+
+    while (rdtsc() < bench_fair_end)
+        loops++;
+
+    arg->loops = loops;
+    __atomic_sub_fetch(&bench_fair_left, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_fair_run(const int* nices) {
+    static struct bench_fair_arg_t args[BENCH_FAIR_THREADS];
+    uint64_t total = 0, weights = 0;
+    size_t worst = 0;
+
+    // Nothing runs before every thread is queued with its nice level
+    size_t flags = irq_save();
+
+    bench_fair_left = BENCH_FAIR_THREADS;
+
+    for (size_t i = 0; i < BENCH_FAIR_THREADS; i++) {
+        args[i].nice = nices[i];
+        args[i].loops = 0;
+
+        tid_t tid = task_tcreate_on(0, bench_fair_thread, &args[i], 0);
+        task_tnice(0, tid, nices[i]);
+
+        weights += task_weight(nices[i]);
+    }
+
+    bench_fair_end = rdtsc() + BENCH_FAIR_MS * tsc_per_ms;
+
+    while (__atomic_load_n(&bench_fair_left, __ATOMIC_ACQUIRE))
+        asm volatile("sti\n\t"
+                     "hlt\n\t"
+                     "cli");
+
+    irq_restore(flags);
+
+    for (size_t i = 0; i < BENCH_FAIR_THREADS; i++)
+        total += args[i].loops;
+
+    for (size_t i = 0; i < BENCH_FAIR_THREADS; i++) {
+        size_t got = total ? args[i].loops * 1000 / total : 0;
+        size_t want = task_weight(args[i].nice) * 1000 / weights;
+        size_t off = got > want ? got - want : want - got;
+
+        if (off > worst)
+            worst = off;
+
+        TRACE("\tnice %3d: %3lu.%lu%% of the CPU, %3lu.%lu%% by weight\n",
+                args[i].nice,
+                got / 10, got % 10,
+                want / 10, want % 10);
+    }
+
+    TRACE("\tfurthest off by %lu.%lu%%\n", worst / 10, worst % 10);
+}
+
+/* Spinning threads all pinned to the BSP, each should get its weight's share of it */
+static void bench_fair() {
+    static const int equal[BENCH_FAIR_THREADS] = { 0, 0, 0, 0 };
+    static const int mixed[BENCH_FAIR_THREADS] = { -5, 0, 5, 10 };
+
+    TRACE("Scheduler fairness, %u threads for %u ms\n",
+            BENCH_FAIR_THREADS,
+            BENCH_FAIR_MS);
+
+    bench_fair_run(equal);
+    bench_fair_run(mixed);
+}
+
+// Each yield is a trip through schedule(), a switch whenever the CPU has another thread queued
+static void bench_sched_thread(void* data) {
+    struct bench_sched_arg_t* arg = data;
+    uint64_t yields = 0;
+
+    while (rdtsc() < bench_sched_start)
+        task_yield();
+
+    while (rdtsc() < bench_sched_end) {
+        task_yield();
+        yields++;
+    }
+
+    arg->yields = yields;
+    __atomic_sub_fetch(&bench_sched_left, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t bench_sched_run(size_t threads) {
+    static struct bench_sched_arg_t args[2 * SMP_MAX_CPUS];
+    uint64_t total = 0;
+
+    size_t flags = irq_save();
+
+    bench_sched_left = threads;
+    bench_sched_start = rdtsc() + 10 * tsc_per_ms;
+    bench_sched_end = bench_sched_start + BENCH_SCHED_MS * tsc_per_ms;
+
+    // Pinned round robin, so the run measures the queues and not the balancer
+    for (size_t i = 0; i < threads; i++) {
+        args[i].yields = 0;
+        task_tcreate_on(0, bench_sched_thread, &args[i], i % smp_cpu_count);
+    }
+
+    while (__atomic_load_n(&bench_sched_left, __ATOMIC_ACQUIRE))
+        asm volatile("sti\n\t"
+                     "hlt\n\t"
+                     "cli");
+
+    irq_restore(flags);
+
+    for (size_t i = 0; i < threads; i++)
+        total += args[i].yields;
+
+    return total / BENCH_SCHED_MS;
+}
+
+// Two of these on one CPU hand it back and forth, every yield is a switch
+static void bench_switch_thread(void* data) {
+    struct bench_switch_arg_t* arg = data;
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        if (arg->irq)
+            asm volatile("int %0" :: "i"(TASK_YIELD_VECTOR) : "memory");
+        else
+            task_yield();
+    }
+
+    arg->cycles = rdtsc() - start;
+    __atomic_sub_fetch(&bench_switch_left, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t bench_switch_run(int irq) {
+    static struct bench_switch_arg_t args[2];
+
+    size_t flags = irq_save();
+
+    bench_switch_left = 2;
+
+    for (size_t i = 0; i < 2; i++) {
+        args[i].irq = irq;
+        args[i].cycles = 0;
+
+        task_tcreate_on(0, bench_switch_thread, &args[i], 0);
+    }
+
+    while (__atomic_load_n(&bench_switch_left, __ATOMIC_ACQUIRE))
+        asm volatile("sti\n\t"
+                     "hlt\n\t"
+                     "cli");
+
+    irq_restore(flags);
+
+    // They ran interleaved, so either one's time covers both their yields
+    uint64_t cycles = args[0].cycles > args[1].cycles ? args[0].cycles : args[1].cycles;
+
+    return cycles / (2 * BENCH_SWITCH_ROUNDS);
+}
+
+/* Yield ping-pong between two threads on the BSP, through iretq and through switch_to */
+static void bench_switch() {
+    TRACE("Context switch, 2 threads, %u yields each\n", BENCH_SWITCH_ROUNDS);
+
+    uint64_t irq = bench_switch_run(1);
+    uint64_t direct = bench_switch_run(0);
+
+    TRACE("\t%-10s %6lu cycles/switch\n", "interrupt", irq);
+    TRACE("\t%-10s %6lu cycles/switch\n", "switch_to", direct);
+}
+
+// Every turn wakes the other thread on its CPU, which has been idle since it went to sleep
+static void bench_wake_thread(void* data) {
+    size_t self = (size_t)data;
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < BENCH_WAKE_ROUNDS; i++) {
+        size_t turn = 2 * i + self;
+
+        wait_event(&bench_wake_wq[self], __atomic_load_n(&bench_wake_turn, __ATOMIC_ACQUIRE) == turn);
+
+        __atomic_store_n(&bench_wake_turn, turn + 1, __ATOMIC_RELEASE);
+        wake_up(&bench_wake_wq[!self]);
+    }
+
+    if (!self)
+        bench_wake_cycles = rdtsc() - start;
+
+    __atomic_sub_fetch(&bench_wake_left, 1, __ATOMIC_RELEASE);
+}
+
+/* Ping-pong between two threads on two idle APs, how long a cross-CPU wakeup takes */
+static void bench_wake() {
+    // The BSP runs the benchmarks from its idle loop, which only halts
+    if (smp_cpu_count < 3) {
+        TRACE("Cross-CPU wakeup needs 3 CPUs, skipped\n");
+        return;
+    }
+
+    TRACE("Cross-CPU wakeup, %u round trips between CPUs 1 and 2\n", BENCH_WAKE_ROUNDS);
+
+    size_t flags = irq_save();
+
+    bench_wake_turn = 0;
+    bench_wake_left = 2;
+
+    for (size_t i = 0; i < 2; i++)
+        task_tcreate_on(0, bench_wake_thread, (void *)i, i + 1);
+
+    while (__atomic_load_n(&bench_wake_left, __ATOMIC_ACQUIRE))
+        asm volatile("sti\n\t"
+                     "hlt\n\t"
+                     "cli");
+
+    irq_restore(flags);
+
+    TRACE("\t%lu cycles/wakeup\n", bench_wake_cycles / (2 * BENCH_WAKE_ROUNDS));
+}
+
+/* Yielding threads on one CPU, then on all of them, throughput should scale with the CPU count */
+static void bench_sched() {
+    const size_t counts[] = { 1, smp_cpu_count, 2 * smp_cpu_count };
+    uint64_t base = 0;
+
+    TRACE("Scheduler throughput, %lu CPUs, %u ms a run\n",
+            smp_cpu_count,
+            BENCH_SCHED_MS);
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        uint64_t rate = bench_sched_run(counts[i]);
+
+        if (!base)
+            base = rate;
+
+        TRACE("\t%3lu threads: %8lu kyields/s aggregate, %lu.%02lux one thread\n",
+                counts[i],
+                rate,
+                base ? rate / base : 0,
+                base ? rate * 100 / base % 100 : 0);
+    }
+}
+
+/* Every CPU reads the same table, readers should scale with the CPU count */
+static void bench_reads() {
+    static const struct bench_read_t reads[] = {
+        { "rwlock", bench_read_rwlock },
+        { "percpu", bench_read_percpu },
+        { "rcu",    bench_read_rcu },
+    };
+    static struct bench_read_arg_t arg;
+
+    TRACE("Read side, %lu CPUs, %u lookups per CPU\n",
+            smp_cpu_count,
+            BENCH_READ_ROUNDS);
+
+    for (size_t i = 0; i < sizeof(reads) / sizeof(reads[0]); i++) {
+        arg.read = &reads[i];
+        smp_run(bench_read_cpu, &arg);
+
+        uint64_t ops = (uint64_t)BENCH_READ_ROUNDS * smp_cpu_count;
+        uint64_t slowest = 0;
+
+        for (size_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+            if (arg.cycles[cpu] > slowest)
+                slowest = arg.cycles[cpu];
+        }
+
+        TRACE("\t%-6s: %lu cycles per lookup on each CPU, %lu kops/s aggregate\n",
+                arg.read->name,
+                slowest / BENCH_READ_ROUNDS,
+                slowest ? (ops * tsc_per_ms) / slowest : 0);
+    }
+}
+
+/* Every CPU hammers one lock, fairness is how far apart the first and last CPU finish */
+static void bench_locks() {
+    static const struct bench_lock_t locks[] = {
+        { "ttas",   bench_ttas_lock,   bench_ttas_release },
+        { "ticket", bench_ticket_lock, bench_ticket_release },
+        { "mcs",    bench_mcs_lock,    bench_mcs_release },
+    };
+    static struct bench_lock_arg_t arg;
+
+    TRACE("Lock contention, %lu CPUs, %u acquisitions per CPU\n",
+            smp_cpu_count,
+            BENCH_LOCK_ROUNDS);
+
+    for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]); i++) {
+        arg.lock = &locks[i];
+        smp_run(bench_lock_cpu, &arg);
+
+        uint64_t ops = BENCH_LOCK_ROUNDS * smp_cpu_count;
+        uint64_t slowest = 0;
+        uint64_t fastest = UINT64_MAX;
+
+        for (size_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+            if (arg.cycles[cpu] > slowest)
+                slowest = arg.cycles[cpu];
+            if (arg.cycles[cpu] < fastest)
+                fastest = arg.cycles[cpu];
+        }
+
+        TRACE("\t%-6s: %lu cycles per lock/unlock on each CPU, %lu kops/s aggregate, first CPU done after %lu%% of the run\n",
+                arg.lock->name,
+                slowest / BENCH_LOCK_ROUNDS,
+                slowest ? (ops * tsc_per_ms) / slowest : 0,
+                slowest ? fastest * 100 / slowest : 0);
+    }
+}
+
+static void bench_kmalloc() {
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096};
+    static struct bench_kmalloc_arg_t arg;
+
+    TRACE("kmalloc/kfree throughput, %lu CPUs, %u ops per CPU\n",
+            smp_cpu_count,
+            BENCH_KMALLOC_ROUNDS * BENCH_KMALLOC_BATCH * 2);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        arg.size = sizes[i];
+        smp_run(bench_kmalloc_cpu, &arg);
+
+        uint64_t ops = BENCH_KMALLOC_ROUNDS * BENCH_KMALLOC_BATCH * 2;
+        uint64_t slowest = 0;
+        uint64_t total = 0;
+
+        for (size_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+            total += arg.cycles[cpu];
+            if (arg.cycles[cpu] > slowest)
+                slowest = arg.cycles[cpu];
+        }
+
+        TRACE("\t%4lu bytes: %lu cycles/op avg, %lu kops/s aggregate\n",
+                arg.size,
+                total / (ops * smp_cpu_count),
+                slowest ? (ops * smp_cpu_count * tsc_per_ms) / slowest : 0);
+    }
+}
+
+void run_benches() {
+    bench_calibrate();
+
+    TRACE("TSC runs at %lu kHz\n", tsc_per_ms);
+
+    bench_kmalloc();
+    bench_locks();
+    bench_reads();
+    bench_fair();
+    bench_sched();
+    bench_switch();
+    bench_wake();
+}
@@ -0,0 +1,14 @@
+#ifndef __KNL__BENCH_H__
+#define __KNL__BENCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <trace.h>
+
+#undef __MODULE__
+#define __MODULE__ "bench"
+
+/* Built in with `make BENCH=1`, run from kmain once everything is up */
+void run_benches();
+
+#endif
@@ -2,6 +2,12 @@
 #include <boot/stivale2.h>
 #include <trace.h>
 #include <mem.h>
+#include <slab.h>
+#include <alloc.h>
+#include <heapprof.h>
+#include <lockstat.h>
+#include <rcu.h>
+#include <arena.h>
 #include <sys/interrupts.h>
 #include <acpi/acpi.h>
 #include <drivers/serial.h>
@@ -10,15 +16,24 @@
 #include <drivers/hpet.h>
 #include <drivers/pci.h>
 #include <sys/smp.h>
+#include <sys/percpu.h>
+#include <sys/fpu.h>
 #include <proc/task.h>
 #include <fs/vfs.h>
 #include <fs/fd.h>
+#include <knl/bench.h>
 
 #undef __MODULE__
 #define __MODULE__ "slate"
 
+/* Time between heap trims, checked whenever the idle loop wakes */
+#define IDLE_TRIM_MS    1000
+
 __attribute__((noreturn))
 void kmain(struct stivale2_struct* info) {
+    // Before anything asks which CPU it is running on
+    init_percpu();
+
     init_serial();
     init_isrs();
 
@@ -46,6 +61,12 @@ void kmain(struct stivale2_struct* info) {
 
     init_vesa(fb);
     init_mem(memmap);
+    init_slab();
+    init_kmalloc();
+    init_heapprof();
+    init_lockstat();
+    init_arena();
+    init_fpu();
 
     init_acpi(rsdp->rsdp + HIGH_VMA);
     init_apic();
@@ -58,6 +79,8 @@ void kmain(struct stivale2_struct* info) {
     init_vfs();
     init_fds();
 
+    init_serial_console();
+
     clear_screen(NULL);
     
     init_scheduler();
@@ -71,8 +94,20 @@ void kmain(struct stivale2_struct* info) {
 
     printf("Built %s %s\n\n", __DATE__, __TIME__);
 
-	while (1) {
-    asm volatile("cli\n\t"
-                 "hlt\n\t");
-	}
+#ifdef BENCH
+    run_benches();
+#endif
+
+    // Idle time is when the heap gives back what it isn't using
+    for (uint64_t trimmed = 0;;) {
+        task_idle();
+        task_halt();
+
+        rcu_qs();
+
+        if (task_clock_ms() - trimmed >= IDLE_TRIM_MS) {
+            kmalloc_trim(kmalloc_retain);
+            trimmed = task_clock_ms();
+        }
+    }
 }
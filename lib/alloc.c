@@ -1,4 +1,20 @@
 #include <lib/alloc.h>
+#include <lib/slab.h>
+#include <lib/heapprof.h>
+#include <proc/task.h>
+#include <drivers/serial.h>
+
+/**
+ * The liballoc entry points below are built as l_malloc etc. and the
+ * public kmalloc family at the bottom wraps them, so the heap profiler
+ * sees every allocation along with the caller that made it.
+ */
+#undef PREFIX
+#define PREFIX(func)        l_ ## func
+
+static void* PREFIX(malloc)(size_t req_size);
+static void  PREFIX(free)(void* ptr);
+static void* PREFIX(realloc)(void* p, size_t size);
 
 /**  Durand's Amazing Super Duper Memory functions.  */
 
@@ -63,9 +79,9 @@ struct liballoc_major
 {
     struct liballoc_major *prev;        ///< Linked list information.
     struct liballoc_major *next;        ///< Linked list information.
-    unsigned int pages;                 ///< The number of pages in the block.
-    unsigned int size;                  ///< The number of pages in the block.
-    unsigned int usage;                 ///< The number of bytes used in the block.
+    size_t pages;                       ///< The number of pages in the block.
+    size_t size;                        ///< The number of bytes in the block.
+    size_t usage;                       ///< The number of bytes used in the block.
     struct liballoc_minor *first;       ///< A pointer to the first allocated memory in the block.
 };
 
@@ -80,18 +96,19 @@ struct  liballoc_minor
     struct liballoc_minor *next;        ///< Linked list information.
     struct liballoc_major *block;       ///< The owning block. A pointer to the major structure.
     unsigned int magic;                 ///< A magic number to idenfity correctness.
-    unsigned int size;                  ///< The size of the memory allocated. Could be 1 byte or more.
-    unsigned int req_size;              ///< The size of memory requested.
+    size_t size;                        ///< The size of the memory allocated. Could be 1 byte or more.
+    size_t req_size;                    ///< The size of memory requested.
 };
 
 
 static struct liballoc_major *l_memRoot = NULL; ///< The root memory block acquired from the system.
 static struct liballoc_major *l_bestBet = NULL; ///< The major with the most free memory.
 
-static unsigned int l_pageSize  = 4096;         ///< The size of an individual page. Set up in liballoc_init.
-static unsigned int l_pageCount = 16;           ///< The number of pages to request per chunk. Set up in liballoc_init.
+static size_t l_pageSize  = 4096;               ///< The size of an individual page. Set up in liballoc_init.
+static size_t l_pageCount = 16;                 ///< The number of pages to request per chunk. Set up in liballoc_init.
 static unsigned long long l_allocated = 0;      ///< Running total of allocated memory.
 static unsigned long long l_inuse    = 0;       ///< Running total of used memory.
+static unsigned long long l_idle     = 0;       ///< Memory in blocks with nothing allocated in them.
 
 
 static long long l_warningCount = 0;        ///< Number of warnings encountered
@@ -100,16 +117,21 @@ static long long l_possibleOverruns = 0;    ///< Number of possible overruns
 
 // ***********   HELPER FUNCTIONS  *******************************
 
-static spinlock_t alloc_lock;
+// The node has to outlive liballoc_lock, so every CPU gets one of its own
+static mcs_lock_t alloc_lock;
+static struct mcs_node_t alloc_nodes[SMP_MAX_CPUS];
 
 int liballoc_lock() {
-    spinlock_lock(&alloc_lock);
+    // Or the thread could move between picking a node and queueing it, onto a CPU already using it
+    preempt_disable();
+    mcs_lock(&alloc_lock, &alloc_nodes[smp_cpu_id()]);
+    preempt_enable();
 
     return 0;
 }
 
 int liballoc_unlock() {
-    spinlock_release(&alloc_lock);
+    mcs_release(&alloc_lock, &alloc_nodes[smp_cpu_id()]);
 
     return 0;
 }
@@ -126,7 +148,7 @@ int liballoc_free(void* ptr, size_t pages) {
 
 static void *liballoc_memset(void* s, int c, size_t n)
 {
-    unsigned int i;
+    size_t i;
     for ( i = 0; i < n ; i++)
         ((char*)s)[i] = c;
 
@@ -136,13 +158,13 @@ static void* liballoc_memcpy(void* s1, const void* s2, size_t n)
 {
   char *cdest;
   char *csrc;
-  unsigned int *ldest = (unsigned int*)s1;
-  unsigned int *lsrc  = (unsigned int*)s2;
+  uint64_t *ldest = (uint64_t*)s1;
+  uint64_t *lsrc  = (uint64_t*)s2;
 
-  while ( n >= sizeof(unsigned int) )
+  while ( n >= sizeof(uint64_t) )
   {
       *ldest++ = *lsrc++;
-      n -= sizeof(unsigned int);
+      n -= sizeof(uint64_t);
   }
 
   cdest = (char*)ldest;
@@ -165,11 +187,14 @@ void liballoc_dump()
 #endif
 
     WARN("Memory Data: \n");
-    WARN("\tSystem memory allocated: %i bytes\n", l_allocated );
-    WARN("\tMemory in used (malloc'ed): %i bytes\n", l_inuse );
-    WARN("\tWarning count: %i\n", l_warningCount );
-    WARN("\tError count: %i\n", l_errorCount );
-    WARN("\tPossible overruns: %i\n", l_possibleOverruns );
+    WARN("\tSystem memory allocated: %llu bytes\n", l_allocated );
+    WARN("\tMemory in used (malloc'ed): %llu bytes\n", l_inuse );
+    WARN("\tMemory idle in empty blocks: %llu bytes\n", l_idle );
+    WARN("\tWarning count: %lld\n", l_warningCount );
+    WARN("\tError count: %lld\n", l_errorCount );
+    WARN("\tPossible overruns: %lld\n", l_possibleOverruns );
+
+    slab_dump();
 
 #ifdef DEBUG
         while ( maj != NULL )
@@ -196,9 +221,9 @@ void liballoc_dump()
 
 // ***************************************************************
 
-static struct liballoc_major *allocate_new_page( unsigned int size )
+static struct liballoc_major *allocate_new_page( size_t size )
 {
-    unsigned int st;
+    size_t st;
     struct liballoc_major *maj;
 
         // This is how much space is required.
@@ -235,6 +260,7 @@ static struct liballoc_major *allocate_new_page( unsigned int size )
         maj->first  = NULL;
 
         l_allocated += maj->size;
+        l_idle += maj->size;
 
         #ifdef DEBUG
         printf(KPRN_WARN, "LIBALLOC", "Resource allocated %x of %i pages (%i bytes) for %i size.\n", maj, st, maj->size, size );
@@ -246,11 +272,22 @@ static struct liballoc_major *allocate_new_page( unsigned int size )
       return maj;
 }
 
+static void free_major( struct liballoc_major *maj )
+{
+    if ( l_memRoot == maj ) l_memRoot = maj->next;
+    if ( l_bestBet == maj ) l_bestBet = NULL;
+    if ( maj->prev != NULL ) maj->prev->next = maj->next;
+    if ( maj->next != NULL ) maj->next->prev = maj->prev;
+    l_allocated -= maj->size;
+
+    liballoc_free( maj, maj->pages );
+}
+
 
 
 
 
-void *PREFIX(malloc)(size_t req_size)
+static void *PREFIX(malloc)(size_t req_size)
 {
     int startedBet = 0;
     unsigned long long bestSize = 0;
@@ -261,6 +298,16 @@ void *PREFIX(malloc)(size_t req_size)
     struct liballoc_minor *new_min;
     unsigned long size = req_size;
 
+    // Small requests are served by the slab size classes, liballoc
+    // only sees what doesn't fit there (or anything before init_slab).
+    if ( req_size <= SLAB_MAX_SIZE && (p = slab_alloc( req_size )) != NULL )
+        return p;
+
+    // Anything that would need a major of its own goes to the pmm in
+    // whole pages with no header, and straight back to it on free.
+    if ( req_size >= l_pageCount * l_pageSize && (p = slab_alloc_aligned( req_size, l_pageSize )) != NULL )
+        return p;
+
     // For alignment, we adjust size so there's enough space to align.
     if ( ALIGNMENT > 1 )
     {
@@ -384,6 +431,8 @@ void *PREFIX(malloc)(size_t req_size)
         // CASE 2: It's a brand new block.
         if ( maj->first == NULL )
         {
+            l_idle -= maj->size;
+
             maj->first = (struct liballoc_minor*)((uintptr_t)maj + sizeof(struct liballoc_major) );
 
 
@@ -582,7 +631,7 @@ void *PREFIX(malloc)(size_t req_size)
     return NULL;
 }
 
-void PREFIX(free)(void *ptr)
+static void PREFIX(free)(void *ptr)
 {
     struct liballoc_minor *min;
     struct liballoc_major *maj;
@@ -597,6 +646,8 @@ void PREFIX(free)(void *ptr)
         return;
     }
 
+    if ( slab_free( ptr ) ) return;
+
     UNALIGN( ptr );
 
     liballoc_lock();        // lockit
@@ -671,26 +722,28 @@ void PREFIX(free)(void *ptr)
 
     // We need to clean up after the majors now....
 
-    if ( maj->first == NULL )   // Block completely unused.
+    // A block that empties out stays on the list for reuse while the
+    // idle ones fit under kmalloc_retain, past that it goes straight back
+    // to the system. It never becomes the best bet so new requests fill
+    // the gaps in blocks in use first. PREFIX(malloc_trim) hands idle
+    // blocks back later once the empty slabs are counted in too.
+    if ( maj->first == NULL )
     {
-        if ( l_memRoot == maj ) l_memRoot = maj->next;
-        if ( l_bestBet == maj ) l_bestBet = NULL;
-        if ( maj->prev != NULL ) maj->prev->next = maj->next;
-        if ( maj->next != NULL ) maj->next->prev = maj->prev;
-        l_allocated -= maj->size;
+        if ( l_idle + maj->size > kmalloc_retain )
+        {
+            free_major( maj );
+            liballoc_unlock();
+            return;
+        }
 
-        liballoc_free( maj, maj->pages );
+        l_idle += maj->size;
     }
-    else
+    else if ( l_bestBet != NULL )
     {
-        if ( l_bestBet != NULL )
-        {
-            int bestSize = l_bestBet->size  - l_bestBet->usage;
-            int majSize = maj->size - maj->usage;
-
-            if ( majSize > bestSize ) l_bestBet = maj;
-        }
+        size_t bestSize = l_bestBet->size  - l_bestBet->usage;
+        size_t majSize = maj->size - maj->usage;
 
+        if ( majSize > bestSize ) l_bestBet = maj;
     }
 
 
@@ -701,25 +754,50 @@ void PREFIX(free)(void *ptr)
     liballoc_unlock();      // release the lock
 }
 
-void* PREFIX(calloc)(size_t nobj, size_t size)
+static void* PREFIX(malloc_aligned)(size_t size, size_t align)
+{
+    // Size classes and liballoc blocks are all at least this aligned.
+    if ( align <= ALIGNMENT ) return PREFIX(malloc)( size );
+
+    return slab_alloc_aligned( size, align );
+}
+
+static void* PREFIX(malloc_node)(size_t size, int node)
+{
+    if ( node != NUMA_NO_NODE && (node < 0 || node >= NUMA_NODES) )
+    {
+        l_warningCount += 1;
+        return NULL;
+    }
+
+    // Every node is node 0 for now, the per-CPU magazines keep
+    // recently freed objects local which is the best we can do.
+    return PREFIX(malloc)( size );
+}
+
+static void* PREFIX(calloc)(size_t nobj, size_t size)
 {
-       int real_size;
+       size_t real_size;
        void *p;
 
+       if ( size != 0 && nobj > SIZE_MAX / size ) return NULL;
+
        real_size = nobj * size;
 
        p = PREFIX(malloc)( real_size );
 
-       liballoc_memset( p, 0, real_size );
+       if ( p != NULL ) liballoc_memset( p, 0, real_size );
 
        return p;
 }
 
-void*   PREFIX(realloc)(void *p, size_t size)
+static void*   PREFIX(realloc)(void *p, size_t size)
 {
     void *ptr;
     struct liballoc_minor *min;
-    unsigned int real_size;
+    struct liballoc_major *maj;
+    size_t real_size;
+    uintptr_t data, limit, need;
 
     // Honour the case of size == 0 => free old and return NULL
     if ( size == 0 )
@@ -731,6 +809,25 @@ void*   PREFIX(realloc)(void *p, size_t size)
     // In the case of a NULL pointer, return a simple malloc.
     if ( p == NULL ) return PREFIX(malloc)( size );
 
+    // Slab objects have no header, the size class is all we know.
+    real_size = slab_size( p );
+    if ( real_size != 0 )
+    {
+        // Page blocks give back their tail or grow into the free pages
+        // behind them.
+        if ( size > SLAB_MAX_SIZE && slab_resize( p, size ) ) return p;
+
+        // Keep the object unless a smaller size class would do.
+        if ( size <= real_size && (size > real_size / 2 || real_size <= SLAB_MIN_SIZE) ) return p;
+
+        ptr = PREFIX(malloc)( size );
+        if ( ptr == NULL ) return size <= real_size ? p : NULL;
+
+        liballoc_memcpy( ptr, p, size < real_size ? size : real_size );
+        PREFIX(free)( p );
+        return ptr;
+    }
+
     // Unalign the pointer if required.
     ptr = p;
     UNALIGN(ptr);
@@ -785,10 +882,24 @@ void*   PREFIX(realloc)(void *p, size_t size)
         // Definitely a memory block.
 
         real_size = min->req_size;
+        maj = min->block;
 
-        if ( real_size >= size )
+        // The alignment padding in front of p stays, only the end moves.
+        // Whatever lies between this minor and the next one is free.
+        data  = (uintptr_t)min + sizeof( struct liballoc_minor );
+        need  = ((uintptr_t)p - data) + size;
+        limit = min->next != NULL ? (uintptr_t)min->next : (uintptr_t)maj + maj->size;
+
+        if ( data + need <= limit && (size <= real_size || size < l_pageCount * l_pageSize) )
         {
+            maj->usage  = maj->usage - min->size + need;
+            l_inuse     = l_inuse - min->size + need;
+            min->size   = need;
             min->req_size = size;
+
+            if ( l_bestBet != NULL && maj->size - maj->usage > l_bestBet->size - l_bestBet->usage )
+                l_bestBet = maj;
+
             liballoc_unlock();
             return p;
         }
@@ -797,8 +908,164 @@ void*   PREFIX(realloc)(void *p, size_t size)
 
     // If we got here then we're reallocating to a block bigger than us.
     ptr = PREFIX(malloc)( size );                   // We need to allocate new memory
+    if ( ptr == NULL ) return NULL;
+
     liballoc_memcpy( ptr, p, real_size );
     PREFIX(free)( p );
 
     return ptr;
 }
+
+static size_t PREFIX(malloc_usable_size)(void *p)
+{
+    struct liballoc_minor *min;
+    void *ptr;
+    size_t size;
+
+    if ( p == NULL ) return 0;
+
+    size = slab_size( p );
+    if ( size != 0 ) return size;
+
+    ptr = p;
+    UNALIGN(ptr);
+
+    liballoc_lock();
+
+    min = (struct liballoc_minor*)((uintptr_t)ptr - sizeof( struct liballoc_minor ));
+
+    if ( min->magic != LIBALLOC_MAGIC )
+    {
+        l_errorCount += 1;
+        liballoc_unlock();
+        return 0;
+    }
+
+    size = (uintptr_t)ptr + min->size - (uintptr_t)p;
+
+    liballoc_unlock();
+
+    return size;
+}
+
+static size_t PREFIX(malloc_trim)(size_t keep)
+{
+    struct liballoc_major *maj, *next;
+    size_t released = 0;
+
+    liballoc_lock();
+
+    for ( maj = l_memRoot; maj != NULL && l_idle > keep; maj = next )
+    {
+        next = maj->next;
+
+        if ( maj->first != NULL ) continue;
+
+        l_idle -= maj->size;
+        released += maj->size;
+
+        free_major( maj );
+    }
+
+    liballoc_unlock();
+
+    return released;
+}
+
+#undef PREFIX
+#define PREFIX(func)        k ## func
+
+size_t kmalloc_retain = KMALLOC_RETAIN;
+
+size_t PREFIX(malloc_trim)(size_t pad)
+{
+    // Empty slabs get first claim on what may stay idle, they're the
+    // cheaper of the two to hand out again.
+    size_t released = slab_trim( pad );
+    size_t idle = slab_idle();
+
+    return released + l_malloc_trim( pad > idle ? pad - idle : 0 );
+}
+
+size_t PREFIX(malloc_idle)()
+{
+    return __atomic_load_n( &l_idle, __ATOMIC_RELAXED ) + slab_idle();
+}
+
+void* PREFIX(malloc)(size_t req_size)
+{
+    void* p = l_malloc( req_size );
+    if ( p == NULL && PREFIX(malloc_trim)( 0 ) ) p = l_malloc( req_size );
+    heapprof_alloc( p, req_size, __builtin_return_address(0) );
+    return p;
+}
+
+void PREFIX(free)(void* ptr)
+{
+    heapprof_free( ptr );
+    l_free( ptr );
+}
+
+void* PREFIX(calloc)(size_t nobj, size_t size)
+{
+    void* p = l_calloc( nobj, size );
+    if ( p == NULL && PREFIX(malloc_trim)( 0 ) ) p = l_calloc( nobj, size );
+    heapprof_alloc( p, nobj * size, __builtin_return_address(0) );
+    return p;
+}
+
+void* PREFIX(realloc)(void* p, size_t size)
+{
+    size_t old = heapprof_free( p );
+    void* ptr = l_realloc( p, size );
+    if ( ptr == NULL && size != 0 && PREFIX(malloc_trim)( 0 ) ) ptr = l_realloc( p, size );
+
+    if ( ptr != NULL ) heapprof_alloc( ptr, size, __builtin_return_address(0) );
+    else if ( size != 0 ) heapprof_alloc( p, old, __builtin_return_address(0) );
+
+    return ptr;
+}
+
+void* PREFIX(malloc_aligned)(size_t size, size_t align)
+{
+    void* p = l_malloc_aligned( size, align );
+    if ( p == NULL && PREFIX(malloc_trim)( 0 ) ) p = l_malloc_aligned( size, align );
+    heapprof_alloc( p, size, __builtin_return_address(0) );
+    return p;
+}
+
+void* PREFIX(malloc_node)(size_t size, int node)
+{
+    void* p = l_malloc_node( size, node );
+    if ( p == NULL && PREFIX(malloc_trim)( 0 ) ) p = l_malloc_node( size, node );
+    heapprof_alloc( p, size, __builtin_return_address(0) );
+    return p;
+}
+
+size_t PREFIX(malloc_usable_size)(void* ptr)
+{
+    return l_malloc_usable_size( ptr );
+}
+
+// "trim [KiB]" shows the idle heap and sets how much of it is retained
+static void kmalloc_trim_cmd(char* args)
+{
+    if ( *args >= '0' && *args <= '9' )
+    {
+        size_t kib = 0;
+
+        while ( *args >= '0' && *args <= '9' )
+            kib = kib * 10 + (*args++ - '0');
+
+        kmalloc_retain = kib * 1024;
+    }
+
+    TRACE("%lu KiB idle, retaining up to %lu KiB\n",
+          PREFIX(malloc_idle)() / 1024,
+          kmalloc_retain / 1024);
+}
+
+void init_kmalloc()
+{
+    serial_register_cmd( "trim", kmalloc_trim_cmd );
+}
@@ -28,6 +28,9 @@
 //This lets you prefix malloc and friends
 #define PREFIX(func)        k ## func
 
+/** Idle heap memory kept around for reuse, trimming gives back the rest. */
+#define KMALLOC_RETAIN      (4ul * 1024 * 1024)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -75,6 +78,17 @@ extern void    *PREFIX(realloc)(void* p, size_t size);      ///< The standard fu
 extern void    *PREFIX(calloc)(size_t nobj, size_t size);       ///< The standard function.
 extern void     PREFIX(free)(void* ptr);                    ///< The standard function.
 
+extern void    *PREFIX(malloc_aligned)(size_t size, size_t align);  ///< Aligned to align (a power of two), freed with kfree.
+extern void    *PREFIX(malloc_node)(size_t size, int node);         ///< Allocated on node (or NUMA_NO_NODE), freed with kfree.
+extern size_t   PREFIX(malloc_usable_size)(void* ptr);              ///< Bytes usable at ptr, at least what was asked for.
+
+extern size_t   PREFIX(malloc_trim)(size_t pad);                    ///< Gives idle memory above pad bytes back to the pmm, returns how much.
+extern size_t   PREFIX(malloc_idle)();                              ///< Bytes held from the pmm with nothing allocated in them.
+
+extern size_t   kmalloc_retain;                                     ///< What the idle loop trims down to, KMALLOC_RETAIN by default.
+
+void init_kmalloc();
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,147 @@
+#include <arena.h>
+#include <mem.h>
+#include <trace.h>
+#include <mm/pmm.h>
+
+#undef __MODULE__
+#define __MODULE__ "arena"
+
+/**
+ * THEORY
+ * ------
+ * An arena hands out memory by bumping a pointer through chunks of
+ * pages taken from the pmm, and gives it all back at once. There is
+ * no per-allocation header and no free, which suits tables built once
+ * at boot and scratch memory that dies with the request it belongs to.
+ *
+ * The arena itself lives at the front of its first chunk. New chunks
+ * are pushed in front of it and become the one being bumped through.
+ * A request too big for a regular chunk gets a chunk of its own,
+ * linked in behind the current one so the space left there isn't lost.
+ * arena_reset frees every chunk but the first.
+ */
+
+#define ARENA_ALIGN_UP(n, align) (((n) + (align) - 1) & ~((uintptr_t)(align) - 1))
+
+struct arena_t* boot_arena;
+
+struct arena_t* arena_create(size_t chunk_pages) {
+    if (!chunk_pages)
+        chunk_pages = ARENA_CHUNK_PAGES;
+
+    struct arena_chunk_t* chunk = pmm_alloc(chunk_pages);
+
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->pages = chunk_pages;
+
+    struct arena_t* arena = (struct arena_t *)(chunk + 1);
+    arena->chunks = chunk;
+    arena->chunk_pages = chunk_pages;
+    arena->cur = ARENA_ALIGN_UP((uintptr_t)(arena + 1), ARENA_ALIGN);
+    arena->end = (uintptr_t)chunk + chunk_pages * PAGESIZE;
+    arena->used = 0;
+    arena->lock = 0;
+
+    return arena;
+}
+
+void* arena_alloc_aligned(struct arena_t* arena, size_t size, size_t align) {
+    if (!arena || !size)
+        return NULL;
+
+    if (align < ARENA_ALIGN)
+        align = ARENA_ALIGN;
+
+    spinlock_lock(&arena->lock);
+
+    uintptr_t ptr = ARENA_ALIGN_UP(arena->cur, align);
+
+    if (ptr + size > arena->end) {
+        size_t need = sizeof(struct arena_chunk_t) + align - 1 + size;
+        size_t pages = ARENA_ALIGN_UP(need, PAGESIZE) / PAGESIZE;
+        size_t own = pages > arena->chunk_pages;
+
+        if (!own)
+            pages = arena->chunk_pages;
+
+        struct arena_chunk_t* chunk = pmm_alloc(pages);
+
+        if (!chunk) {
+            spinlock_release(&arena->lock);
+            return NULL;
+        }
+
+        chunk->pages = pages;
+        ptr = ARENA_ALIGN_UP((uintptr_t)(chunk + 1), align);
+
+        if (own) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+            arena->end = (uintptr_t)chunk + pages * PAGESIZE;
+            arena->cur = ptr + size;
+        }
+    } else {
+        arena->cur = ptr + size;
+    }
+
+    arena->used += size;
+
+    spinlock_release(&arena->lock);
+
+    return (void *)ptr;
+}
+
+void* arena_alloc(struct arena_t* arena, size_t size) {
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+void arena_reset(struct arena_t* arena) {
+    struct arena_chunk_t* first = (struct arena_chunk_t *)arena - 1;
+
+    spinlock_lock(&arena->lock);
+
+    for (struct arena_chunk_t* chunk = arena->chunks; chunk; ) {
+        struct arena_chunk_t* next = chunk->next;
+
+        if (chunk != first)
+            pmm_free(chunk, chunk->pages);
+
+        chunk = next;
+    }
+
+    first->next = NULL;
+    arena->chunks = first;
+    arena->cur = ARENA_ALIGN_UP((uintptr_t)(arena + 1), ARENA_ALIGN);
+    arena->end = (uintptr_t)first + first->pages * PAGESIZE;
+    arena->used = 0;
+
+    spinlock_release(&arena->lock);
+}
+
+void arena_destroy(struct arena_t* arena) {
+    struct arena_chunk_t* chunk = arena->chunks;
+
+    // the arena lives in one of the chunks, only chunk->next is read once freeing starts
+    while (chunk) {
+        struct arena_chunk_t* next = chunk->next;
+        pmm_free(chunk, chunk->pages);
+        chunk = next;
+    }
+}
+
+void init_arena() {
+    boot_arena = arena_create(0);
+
+    if (!boot_arena) {
+        ERR("Unable to create the boot arena\n");
+        return;
+    }
+
+    TRACE("Boot arena at %#lx\n", (uintptr_t)boot_arena);
+}
@@ -0,0 +1,40 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <locks.h>
+
+#define ARENA_ALIGN         16
+#define ARENA_CHUNK_PAGES   4
+
+/* Header at the start of every chunk of pages an arena owns */
+struct arena_chunk_t {
+    struct arena_chunk_t* next;
+    size_t pages;
+};
+
+struct arena_t {
+    struct arena_chunk_t* chunks;
+    size_t chunk_pages;
+
+    uintptr_t cur;
+    uintptr_t end;
+
+    size_t used;
+
+    spinlock_t lock;
+};
+
+/* Init-time tables that live for as long as the kernel does */
+extern struct arena_t* boot_arena;
+
+struct arena_t* arena_create(size_t chunk_pages);
+void* arena_alloc(struct arena_t* arena, size_t size);
+void* arena_alloc_aligned(struct arena_t* arena, size_t size, size_t align);
+void arena_reset(struct arena_t* arena);
+void arena_destroy(struct arena_t* arena);
+
+void init_arena();
+
+#endif
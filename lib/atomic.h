@@ -0,0 +1,128 @@
+#ifndef __ATOMIC_H__
+#define __ATOMIC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * THEORY
+ * ------
+ * Thin typed wrappers over the compiler's __atomic builtins. Every
+ * operation takes its memory order explicitly, so the ordering a
+ * lock-free structure relies on is written down at each access instead
+ * of being implied by a default:
+ *
+ *  ATOMIC_RELAXED  atomic, orders nothing around it (counters, stats)
+ *  ATOMIC_ACQUIRE  later accesses stay after it (taking a lock, reading a flag)
+ *  ATOMIC_RELEASE  earlier accesses stay before it (dropping a lock, publishing)
+ *  ATOMIC_ACQ_REL  both, for read-modify-writes
+ *  ATOMIC_SEQ_CST  one total order, for store-then-load handshakes
+ *
+ * atomic_t and atomic64_t are wrapped in a struct so a plain access
+ * doesn't compile. READ_ONCE and WRITE_ONCE are for plain variables that
+ * are shared anyway: they stop the compiler tearing, fusing or
+ * re-reading the access but order nothing.
+ *
+ * On x86 every locked instruction is a full barrier and only stores
+ * followed by loads can be reordered, so smp_rmb and smp_wmb cost
+ * nothing and smp_mb is the only one that emits an instruction.
+ */
+
+#define ATOMIC_RELAXED  __ATOMIC_RELAXED
+#define ATOMIC_ACQUIRE  __ATOMIC_ACQUIRE
+#define ATOMIC_RELEASE  __ATOMIC_RELEASE
+#define ATOMIC_ACQ_REL  __ATOMIC_ACQ_REL
+#define ATOMIC_SEQ_CST  __ATOMIC_SEQ_CST
+
+#define barrier()       asm volatile("" ::: "memory")
+#define cpu_relax()     asm volatile("pause" ::: "memory")
+
+// A locked add to the stack top is cheaper than mfence and orders the same for normal memory
+#define smp_mb()        asm volatile("lock addl $0, (%%rsp)" ::: "memory", "cc")
+#define smp_rmb()       barrier()
+#define smp_wmb()       barrier()
+
+#define READ_ONCE(x)        (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)    (*(volatile __typeof__(x) *)&(x) = (v))
+
+#define smp_load_acquire(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+typedef struct {
+    volatile int32_t counter;
+} atomic_t;
+
+typedef struct {
+    volatile int64_t counter;
+} atomic64_t;
+
+#define ATOMIC_INIT(i)  { (i) }
+
+#define ATOMIC_OPS(prefix, atomic_type, type)                                               \
+static inline type prefix##_read(const atomic_type* v, int order) {                         \
+    return __atomic_load_n(&v->counter, order);                                             \
+}                                                                                           \
+                                                                                            \
+static inline void prefix##_set(atomic_type* v, type i, int order) {                        \
+    __atomic_store_n(&v->counter, i, order);                                                \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_fetch_add(atomic_type* v, type i, int order) {                  \
+    return __atomic_fetch_add(&v->counter, i, order);                                       \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_fetch_sub(atomic_type* v, type i, int order) {                  \
+    return __atomic_fetch_sub(&v->counter, i, order);                                       \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_fetch_and(atomic_type* v, type i, int order) {                  \
+    return __atomic_fetch_and(&v->counter, i, order);                                       \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_fetch_or(atomic_type* v, type i, int order) {                   \
+    return __atomic_fetch_or(&v->counter, i, order);                                        \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_add_return(atomic_type* v, type i, int order) {                 \
+    return __atomic_add_fetch(&v->counter, i, order);                                       \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_sub_return(atomic_type* v, type i, int order) {                 \
+    return __atomic_sub_fetch(&v->counter, i, order);                                       \
+}                                                                                           \
+                                                                                            \
+static inline type prefix##_xchg(atomic_type* v, type i, int order) {                       \
+    return __atomic_exchange_n(&v->counter, i, order);                                      \
+}                                                                                           \
+                                                                                            \
+/* Returns what was there, the swap happened if that is old */                              \
+static inline type prefix##_cmpxchg(atomic_type* v, type old, type new, int order) {        \
+    __atomic_compare_exchange_n(&v->counter, &old, new, 0, order, __ATOMIC_RELAXED);        \
+    return old;                                                                             \
+}                                                                                           \
+                                                                                            \
+/* Like cmpxchg, but updates *old on failure so a retry loop can go straight round */       \
+static inline int prefix##_try_cmpxchg(atomic_type* v, type* old, type new, int order) {    \
+    return __atomic_compare_exchange_n(&v->counter, old, new, 0, order, __ATOMIC_RELAXED);  \
+}
+
+ATOMIC_OPS(atomic, atomic_t, int32_t)
+ATOMIC_OPS(atomic64, atomic64_t, int64_t)
+
+#undef ATOMIC_OPS
+
+#define atomic_inc(v)       atomic_fetch_add(v, 1, ATOMIC_RELAXED)
+#define atomic_dec(v)       atomic_fetch_sub(v, 1, ATOMIC_RELAXED)
+#define atomic64_inc(v)     atomic64_fetch_add(v, 1, ATOMIC_RELAXED)
+#define atomic64_dec(v)     atomic64_fetch_sub(v, 1, ATOMIC_RELAXED)
+
+/* Reference counts on plain ints, nonzero while references are left */
+static inline int locked_inc(volatile int* var) {
+    return __atomic_add_fetch(var, 1, __ATOMIC_ACQ_REL) != 0;
+}
+
+static inline int locked_dec(volatile int* var) {
+    return __atomic_sub_fetch(var, 1, __ATOMIC_ACQ_REL) != 0;
+}
+
+#endif
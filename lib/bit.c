@@ -16,21 +16,21 @@ void set_bit(uint8_t* num, uint8_t bit, uint8_t state) {
 
 uint8_t get_abs_bit(uint64_t* bitmap, uint64_t bit) {
     size_t off = bit / 64;
-    size_t mask = (1 << (bit % 64));
+    uint64_t mask = (1ull << (bit % 64));
 
     return (bitmap[off] & mask) == mask;
 }
 
 void set_abs_bit(uint64_t* bitmap, uint64_t bit) {
     size_t off = bit / 64;
-    //size_t mask = (1 << (bit % 64));
+    uint64_t mask = (1ull << (bit % 64));
 
-    bitmap[off] = (bitmap[off] | (1 << bit));
+    bitmap[off] |= mask;
 }
 
 void cls_abs_bit(uint64_t* bitmap, uint64_t bit) {
     size_t off = bit / 64;
-    //size_t mask = (1 << (bit % 64));
+    uint64_t mask = (1ull << (bit % 64));
 
-    bitmap[off] &= ~(1 << bit);
+    bitmap[off] &= ~mask;
 }
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <alloc.h>
 #include <locks.h>
+#include <atomic.h>
 
 #define dynarray_new(type, name) \
     static struct { \
@@ -0,0 +1,231 @@
+// Included either way so the file is never an empty translation unit
+#include <heapprof.h>
+
+#ifdef HEAPPROF
+
+#include <mem.h>
+#include <str.h>
+#include <trace.h>
+#include <locks.h>
+#include <mm/pmm.h>
+#include <sys/interrupts.h>
+#include <drivers/serial.h>
+
+#undef __MODULE__
+#define __MODULE__ "hprof"
+
+/**
+ * THEORY
+ * ------
+ * Every kmalloc family call records the returned pointer, its size and
+ * the caller's return address in an open addressed table (linear
+ * probing, backward shift on delete so there are no tombstones). The
+ * caller address picks an entry in a second table of call sites that
+ * keeps live and total counts, so a free only has to find the pointer
+ * to know which site to charge.
+ *
+ * Both tables are fixed size and take no memory from the heap they
+ * watch. Once either fills up further allocations go untracked and
+ * are counted as dropped rather than failing.
+ *
+ * Built only with HEAPPROF=1, the hooks are empty otherwise.
+ */
+
+#define PTR_KEY(ptr) \
+    ((uintptr_t)(ptr) >= HIGH_VMA ? (uintptr_t)(ptr) - HIGH_VMA : (uintptr_t)(ptr))
+
+#define HASH(key) (((key) * 0x9E3779B97F4A7C15ull) >> 32)
+
+struct heapprof_ptr_t {
+    size_t ptr;
+    size_t size;
+    size_t site;
+};
+
+static struct heapprof_ptr_t* ptrs;
+static size_t ptr_cnt;
+
+static struct heapprof_site_t sites[HEAPPROF_SITES];
+static size_t site_cnt;
+
+static size_t dropped;
+
+static spinlock_t heapprof_lock;
+
+static struct heapprof_site_t* site_get(size_t site) {
+    size_t i = HASH(site) & (HEAPPROF_SITES - 1);
+
+    for (;; i = (i + 1) & (HEAPPROF_SITES - 1)) {
+        if (sites[i].site == site)
+            return &sites[i];
+
+        if (!sites[i].site) {
+            // keep one slot free so lookups terminate
+            if (site_cnt == HEAPPROF_SITES - 1)
+                return NULL;
+
+            site_cnt++;
+            sites[i].site = site;
+            return &sites[i];
+        }
+    }
+}
+
+void heapprof_alloc(void* ptr, size_t size, void* site) {
+    if (!ptrs || !ptr)
+        return;
+
+    size_t key = PTR_KEY(ptr);
+    size_t flags = irq_save();
+    spinlock_lock(&heapprof_lock);
+
+    struct heapprof_site_t* s = site_get((size_t)site);
+
+    if (!s || ptr_cnt == HEAPPROF_PTRS - 1) {
+        dropped++;
+        goto out;
+    }
+
+    size_t i = HASH(key) & (HEAPPROF_PTRS - 1);
+    while (ptrs[i].ptr && ptrs[i].ptr != key)
+        i = (i + 1) & (HEAPPROF_PTRS - 1);
+
+    if (!ptrs[i].ptr)
+        ptr_cnt++;
+
+    ptrs[i].ptr = key;
+    ptrs[i].size = size;
+    ptrs[i].site = s - sites;
+
+    s->live_bytes += size;
+    s->live_cnt++;
+    s->allocs++;
+    s->bytes += size;
+
+out:
+    spinlock_release(&heapprof_lock);
+    irq_restore(flags);
+}
+
+size_t heapprof_free(void* ptr) {
+    if (!ptrs || !ptr)
+        return 0;
+
+    size_t key = PTR_KEY(ptr);
+    size_t size = 0;
+    size_t flags = irq_save();
+    spinlock_lock(&heapprof_lock);
+
+    size_t i = HASH(key) & (HEAPPROF_PTRS - 1);
+    while (ptrs[i].ptr && ptrs[i].ptr != key)
+        i = (i + 1) & (HEAPPROF_PTRS - 1);
+
+    if (!ptrs[i].ptr)
+        goto out;
+
+    struct heapprof_site_t* s = &sites[ptrs[i].site];
+    size = ptrs[i].size;
+    s->live_bytes -= size;
+    s->live_cnt--;
+
+    // shift the rest of the cluster back over the hole
+    size_t hole = i;
+    for (size_t j = (i + 1) & (HEAPPROF_PTRS - 1); ptrs[j].ptr; j = (j + 1) & (HEAPPROF_PTRS - 1)) {
+        size_t home = HASH(ptrs[j].ptr) & (HEAPPROF_PTRS - 1);
+
+        // only move entries whose home isn't cyclically in (hole, j]
+        if (((j - home) & (HEAPPROF_PTRS - 1)) >= ((j - hole) & (HEAPPROF_PTRS - 1))) {
+            ptrs[hole] = ptrs[j];
+            hole = j;
+        }
+    }
+
+    ptrs[hole].ptr = 0;
+    ptr_cnt--;
+
+out:
+    spinlock_release(&heapprof_lock);
+    irq_restore(flags);
+
+    return size;
+}
+
+void heapprof_dump(size_t n) {
+    struct heapprof_site_t top[HEAPPROF_TOP_MAX];
+    size_t top_cnt = 0;
+    size_t live_bytes = 0, live_cnt = 0;
+
+    if (n > HEAPPROF_TOP_MAX)
+        n = HEAPPROF_TOP_MAX;
+
+    // snapshot under the lock, print without it
+    size_t flags = irq_save();
+    spinlock_lock(&heapprof_lock);
+
+    for (size_t i = 0; i < HEAPPROF_SITES; i++) {
+        if (!sites[i].site)
+            continue;
+
+        live_bytes += sites[i].live_bytes;
+        live_cnt += sites[i].live_cnt;
+
+        if (!sites[i].live_cnt)
+            continue;
+
+        size_t j = top_cnt < n ? top_cnt++ : n;
+        for (; j > 0 && top[j - 1].live_bytes < sites[i].live_bytes; j--) {
+            if (j < n)
+                top[j] = top[j - 1];
+        }
+
+        if (j < n)
+            top[j] = sites[i];
+    }
+
+    size_t total_sites = site_cnt;
+    size_t total_dropped = dropped;
+
+    spinlock_release(&heapprof_lock);
+    irq_restore(flags);
+
+    TRACE("%lu bytes live in %lu allocations from %lu sites (%lu untracked)\n",
+          live_bytes, live_cnt, total_sites, total_dropped);
+
+    for (size_t i = 0; i < top_cnt; i++) {
+        size_t off;
+        char* name = trace_addr(&off, top[i].site);
+
+        TRACE("\t%10lu B %6lu live %8lu allocs %12lu B total <%s+%#lx>\n",
+              top[i].live_bytes, top[i].live_cnt,
+              top[i].allocs, top[i].bytes,
+              name, off);
+    }
+}
+
+static void heapprof_cmd(char* args) {
+    size_t n = 0;
+
+    while (*args >= '0' && *args <= '9')
+        n = n * 10 + (*args++ - '0');
+
+    heapprof_dump(n ? n : 10);
+}
+
+void init_heapprof() {
+    size_t pages = HEAPPROF_PTRS * sizeof(struct heapprof_ptr_t) / PAGESIZE;
+
+    struct heapprof_ptr_t* table = pmm_alloc(pages);
+    if (!table) {
+        WARN("Couldn't allocate %lu pages, profiling disabled\n", pages);
+        return;
+    }
+
+    memset(table, 0, pages * PAGESIZE);
+    ptrs = table;
+
+    serial_register_cmd("heap", heapprof_cmd);
+
+    TRACE("Tracking up to %d allocations\n", HEAPPROF_PTRS);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __HEAPPROF_H__
+#define __HEAPPROF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Live allocations tracked at once, a power of two */
+#define HEAPPROF_PTRS       0x10000
+/* Distinct call sites, a power of two */
+#define HEAPPROF_SITES      1024
+/* Most sites a single dump prints */
+#define HEAPPROF_TOP_MAX    32
+
+#ifdef HEAPPROF
+
+struct heapprof_site_t {
+    size_t site;
+
+    size_t live_bytes;
+    size_t live_cnt;
+
+    size_t allocs;
+    size_t bytes;
+};
+
+void heapprof_alloc(void* ptr, size_t size, void* site);
+size_t heapprof_free(void* ptr);
+void heapprof_dump(size_t n);
+
+void init_heapprof();
+
+#else
+
+static inline void heapprof_alloc(void* ptr, size_t size, void* site) {
+    (void)ptr;
+    (void)size;
+    (void)site;
+}
+
+static inline size_t heapprof_free(void* ptr) {
+    (void)ptr;
+    return 0;
+}
+
+static inline void heapprof_dump(size_t n) {
+    (void)n;
+}
+
+static inline void init_heapprof() {}
+
+#endif
+
+#endif
@@ -3,9 +3,74 @@
 
 #include <stdint.h>
 
+/**
+ * THEORY
+ * ------
+ * spinlock_t is a ticket lock. The low half of the word hands out
+ * tickets, the high half is the ticket being served, so CPUs get the
+ * lock in the order they asked for it and a zeroed word is unlocked.
+ * Every waiter still polls the same line, which is fine while only a
+ * couple of CPUs ever meet there.
+ *
+ * Hot global locks are MCS locks instead. The lock word points at the
+ * last waiter, every waiter spins on a node of its own and the holder
+ * hands the lock straight to the next one on release, so contention
+ * costs one cache line transfer per hand-off instead of a storm. The
+ * node has to live until mcs_release, a local is fine when both happen
+ * in the same function.
+ *
+ * Both are fair, so a CPU must never take a lock from an interrupt
+ * that can arrive while it is queued for that same lock: it would wait
+ * behind itself. Locks shared with interrupt handlers are taken with
+ * interrupts off.
+ *
+ * rwlock_t is one word: the low bits count readers, RWLOCK_WRITER is set
+ * while a writer holds it and RWLOCK_WAITING while one is queued for it.
+ * Readers only get in while neither bit is set, so a steady stream of
+ * lookups cannot starve an update. A writer sets RWLOCK_WAITING, waits
+ * for the readers to drain and swaps the word to RWLOCK_WRITER. Readers
+ * wait for a queued writer, so the rule above covers taking a read lock
+ * twice on one CPU as well. Readers and writers hold preemption off
+ * while they wait and hold, as the asm locks do, or a holder switched
+ * out would leave waiters on its CPU spinning for a whole slice.
+ *
+ * Built with LOCKSTAT=1 the asm locks are renamed raw_* and the names
+ * below go to lib/lockstat.c, which times every spinlock_t and mcs_lock_t
+ * acquisition around the raw one and files it under its call site.
+ */
+
 typedef volatile uint64_t spinlock_t;
 
+struct mcs_node_t {
+    struct mcs_node_t* volatile next;
+    volatile uint64_t locked;
+} __attribute__((aligned(64)));
+
+typedef struct mcs_node_t* volatile mcs_lock_t;
+
+#define RWLOCK_WRITER   (1ul << 63)
+#define RWLOCK_WAITING  (1ul << 62)
+#define RWLOCK_READERS  (RWLOCK_WAITING - 1)
+
+typedef volatile uint64_t rwlock_t;
+
 void spinlock_lock(spinlock_t* spinlock);
 void spinlock_release(spinlock_t* spinlock);
 
+void mcs_lock(mcs_lock_t* lock, struct mcs_node_t* node);
+void mcs_release(mcs_lock_t* lock, struct mcs_node_t* node);
+
+#ifdef LOCKSTAT
+void raw_spinlock_lock(spinlock_t* spinlock);
+void raw_spinlock_release(spinlock_t* spinlock);
+
+void raw_mcs_lock(mcs_lock_t* lock, struct mcs_node_t* node);
+void raw_mcs_release(mcs_lock_t* lock, struct mcs_node_t* node);
+#endif
+
+void read_lock(rwlock_t* lock);
+void read_release(rwlock_t* lock);
+void write_lock(rwlock_t* lock);
+void write_release(rwlock_t* lock);
+
 #endif
@@ -0,0 +1,274 @@
+// Included either way so the file is never an empty translation unit
+#include <lockstat.h>
+
+#ifdef LOCKSTAT
+
+#include <locks.h>
+#include <atomic.h>
+#include <mem.h>
+#include <str.h>
+#include <trace.h>
+#include <sys/smp.h>
+#include <sys/msrs.h>
+#include <sys/interrupts.h>
+#include <drivers/serial.h>
+
+#undef __MODULE__
+#define __MODULE__ "lstat"
+
+/**
+ * THEORY
+ * ------
+ * spinlock_lock and mcs_lock stamp the TSC around the raw asm lock and
+ * charge the wait to the caller's return address in an open addressed
+ * table of call sites, the same way heapprof keys allocations. A lock
+ * counts as contended if it was already taken when we got there.
+ *
+ * Hold time needs the acquisition stamp at release, and there is no
+ * room for it in the lock word, so each CPU keeps a short stack of the
+ * locks it holds. Releasing a lock this CPU didn't take, or one taken
+ * while the stack was full, just goes without a hold time.
+ *
+ * Nothing here may take a lock, everything it touches would recurse
+ * into it. Sites are claimed with a CAS and counted with atomic adds,
+ * so CPUs only meet on the line of the site they share.
+ *
+ * Built only with LOCKSTAT=1, the plain asm locks are used otherwise.
+ */
+
+#define HASH(key) (((key) * 0x9E3779B97F4A7C15ull) >> 32)
+
+struct lockstat_held_t {
+    void* lock;
+    struct lockstat_site_t* site;
+    uint64_t start;
+};
+
+struct lockstat_cpu_t {
+    struct lockstat_held_t held[LOCKSTAT_DEPTH];
+    size_t depth;
+} __attribute__((aligned(64)));
+
+static struct lockstat_site_t sites[LOCKSTAT_SITES];
+static atomic64_t site_cnt;
+static atomic64_t dropped;
+
+static struct lockstat_cpu_t cpus[SMP_MAX_CPUS];
+
+static struct lockstat_site_t* site_get(size_t site) {
+    size_t i = HASH(site) & (LOCKSTAT_SITES - 1);
+
+    for (;; i = (i + 1) & (LOCKSTAT_SITES - 1)) {
+        size_t cur = READ_ONCE(sites[i].site);
+
+        if (cur == site)
+            return &sites[i];
+
+        if (cur)
+            continue;
+
+        // keep one slot free so lookups terminate
+        if (atomic64_add_return(&site_cnt, 1, ATOMIC_RELAXED) >= LOCKSTAT_SITES) {
+            atomic64_dec(&site_cnt);
+            return NULL;
+        }
+
+        if (__atomic_compare_exchange_n(&sites[i].site, &cur, site, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return &sites[i];
+
+        // Someone else took the slot, maybe for this very site
+        atomic64_dec(&site_cnt);
+
+        if (cur == site)
+            return &sites[i];
+    }
+}
+
+static void stat_max(volatile uint64_t* max, uint64_t val) {
+    uint64_t cur = READ_ONCE(*max);
+
+    while (cur < val && !__atomic_compare_exchange_n(max, &cur, val, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void lockstat_acquired(void* lock, void* site, int contended, uint64_t start) {
+    uint64_t now = rdtsc();
+    struct lockstat_site_t* s = site_get((size_t)site);
+
+    if (!s) {
+        atomic64_inc(&dropped);
+        return;
+    }
+
+    WRITE_ONCE(s->lock, (size_t)lock);
+    __atomic_add_fetch(&s->acquired, 1, __ATOMIC_RELAXED);
+
+    if (contended) {
+        __atomic_add_fetch(&s->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->spin, now - start, __ATOMIC_RELAXED);
+        stat_max(&s->spin_max, now - start);
+    }
+
+    size_t flags = irq_save();
+    struct lockstat_cpu_t* cpu = &cpus[smp_cpu_id()];
+
+    if (cpu->depth < LOCKSTAT_DEPTH) {
+        cpu->held[cpu->depth].lock = lock;
+        cpu->held[cpu->depth].site = s;
+        cpu->held[cpu->depth].start = now;
+        cpu->depth++;
+    }
+
+    irq_restore(flags);
+}
+
+static void lockstat_released(void* lock) {
+    uint64_t now = rdtsc();
+    size_t flags = irq_save();
+    struct lockstat_cpu_t* cpu = &cpus[smp_cpu_id()];
+
+    // Usually the top one, locks are mostly released in reverse order
+    for (size_t i = cpu->depth; i-- > 0;) {
+        if (cpu->held[i].lock != lock)
+            continue;
+
+        struct lockstat_site_t* s = cpu->held[i].site;
+        uint64_t held = now - cpu->held[i].start;
+
+        for (; i + 1 < cpu->depth; i++)
+            cpu->held[i] = cpu->held[i + 1];
+
+        cpu->depth--;
+
+        __atomic_add_fetch(&s->held, held, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->held_cnt, 1, __ATOMIC_RELAXED);
+        stat_max(&s->held_max, held);
+        break;
+    }
+
+    irq_restore(flags);
+}
+
+void spinlock_lock(spinlock_t* spinlock) {
+    uint64_t start = rdtsc();
+    uint64_t v = READ_ONCE(*spinlock);
+
+    raw_spinlock_lock(spinlock);
+    lockstat_acquired((void *)spinlock, __builtin_return_address(0), (uint32_t)v != (uint32_t)(v >> 32), start);
+}
+
+void spinlock_release(spinlock_t* spinlock) {
+    lockstat_released((void *)spinlock);
+    raw_spinlock_release(spinlock);
+}
+
+void mcs_lock(mcs_lock_t* lock, struct mcs_node_t* node) {
+    uint64_t start = rdtsc();
+    int contended = READ_ONCE(*lock) != NULL;
+
+    raw_mcs_lock(lock, node);
+    lockstat_acquired((void *)lock, __builtin_return_address(0), contended, start);
+}
+
+void mcs_release(mcs_lock_t* lock, struct mcs_node_t* node) {
+    lockstat_released((void *)lock);
+    raw_mcs_release(lock, node);
+}
+
+static int stat_before(struct lockstat_site_t* a, struct lockstat_site_t* b) {
+    if (a->contended != b->contended)
+        return a->contended > b->contended;
+
+    return a->spin > b->spin;
+}
+
+void lockstat_dump(size_t n) {
+    struct lockstat_site_t top[LOCKSTAT_TOP_MAX];
+    size_t top_cnt = 0;
+    uint64_t acquired = 0, contended = 0;
+
+    if (n > LOCKSTAT_TOP_MAX)
+        n = LOCKSTAT_TOP_MAX;
+
+    // Counters keep moving while we read them, a dump is a rough snapshot
+    for (size_t i = 0; i < LOCKSTAT_SITES; i++) {
+        if (!READ_ONCE(sites[i].site))
+            continue;
+
+        struct lockstat_site_t s = sites[i];
+
+        acquired += s.acquired;
+        contended += s.contended;
+
+        if (!s.acquired)
+            continue;
+
+        size_t j = top_cnt < n ? top_cnt++ : n;
+        for (; j > 0 && stat_before(&s, &top[j - 1]); j--) {
+            if (j < n)
+                top[j] = top[j - 1];
+        }
+
+        if (j < n)
+            top[j] = s;
+    }
+
+    TRACE("%lu acquisitions, %lu contended, from %lu sites (%lu untracked)\n",
+          acquired, contended,
+          atomic64_read(&site_cnt, ATOMIC_RELAXED),
+          atomic64_read(&dropped, ATOMIC_RELAXED));
+
+    TRACE("\t%10s %10s %5s %12s %10s %10s %10s  %-18s site\n",
+          "acquired", "contended", "%", "spin total", "spin max", "hold avg", "hold max", "lock");
+
+    for (size_t i = 0; i < top_cnt; i++) {
+        size_t off;
+        char* name = trace_addr(&off, top[i].site);
+
+        TRACE("\t%10lu %10lu %4lu%% %12lu %10lu %10lu %10lu  %#-18lx <%s+%#lx>\n",
+              top[i].acquired, top[i].contended,
+              top[i].contended * 100 / top[i].acquired,
+              top[i].spin, top[i].spin_max,
+              top[i].held_cnt ? top[i].held / top[i].held_cnt : 0,
+              top[i].held_max,
+              top[i].lock,
+              name, off);
+    }
+}
+
+void lockstat_reset() {
+    // Sites stay claimed, only their counts go back to zero
+    for (size_t i = 0; i < LOCKSTAT_SITES; i++) {
+        WRITE_ONCE(sites[i].acquired, 0);
+        WRITE_ONCE(sites[i].contended, 0);
+        WRITE_ONCE(sites[i].spin, 0);
+        WRITE_ONCE(sites[i].spin_max, 0);
+        WRITE_ONCE(sites[i].held, 0);
+        WRITE_ONCE(sites[i].held_cnt, 0);
+        WRITE_ONCE(sites[i].held_max, 0);
+    }
+
+    atomic64_set(&dropped, 0, ATOMIC_RELAXED);
+}
+
+static void lockstat_cmd(char* args) {
+    if (!strcmp(args, "reset")) {
+        lockstat_reset();
+        return;
+    }
+
+    size_t n = 0;
+
+    while (*args >= '0' && *args <= '9')
+        n = n * 10 + (*args++ - '0');
+
+    lockstat_dump(n ? n : 10);
+}
+
+void init_lockstat() {
+    serial_register_cmd("lock", lockstat_cmd);
+
+    TRACE("Timing locks from up to %d call sites, cycles are TSC\n", LOCKSTAT_SITES);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __LOCKSTAT_H__
+#define __LOCKSTAT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Distinct call sites taking locks, a power of two */
+#define LOCKSTAT_SITES      1024
+/* Locks one CPU can hold at once and still have hold times measured */
+#define LOCKSTAT_DEPTH      16
+/* Most sites a single dump prints */
+#define LOCKSTAT_TOP_MAX    32
+
+#ifdef LOCKSTAT
+
+struct lockstat_site_t {
+    volatile size_t site;
+    volatile size_t lock;
+
+    volatile uint64_t acquired;
+    volatile uint64_t contended;
+
+    volatile uint64_t spin;
+    volatile uint64_t spin_max;
+
+    volatile uint64_t held;
+    volatile uint64_t held_cnt;
+    volatile uint64_t held_max;
+};
+
+void lockstat_dump(size_t n);
+void lockstat_reset();
+
+void init_lockstat();
+
+#else
+
+static inline void lockstat_dump(size_t n) {
+    (void)n;
+}
+static inline void lockstat_reset() {}
+
+static inline void init_lockstat() {}
+
+#endif
+
+#endif
@@ -46,7 +46,10 @@ void init_mem(struct stivale2_struct_tag_memmap* memmap) {
         vmm_map((uint64_t *)i, (uint64_t *)i, get_pml4(), TABLEPRESENT | TABLEWRITE);
     }
 
-    memset(pmm_bitmap, 0, totalmem / PAGESIZE / 8);
+    uint64_t pages = totalmem / PAGESIZE;
+
+    // everything starts out used, only usable ranges are released below
+    memset(pmm_bitmap, 0xFF, (pages + 7) / 8);
 
     for (uint64_t i = 0; i < memmap->entries; i++) {
         TRACE("\t%#016x - %#016x: ",
@@ -77,11 +80,19 @@ void init_mem(struct stivale2_struct_tag_memmap* memmap) {
                 break;
         }
 
-        if (entry[i].type != STIVALE2_MMAP_USABLE) {
-            set_abs_bit(pmm_bitmap, entry[i].base / PAGESIZE);
+        if (entry[i].type == STIVALE2_MMAP_USABLE) {
+            uint64_t end = (entry[i].base + entry[i].length) / PAGESIZE;
+
+            for (uint64_t page = entry[i].base / PAGESIZE; page < end && page < pages; page++)
+                cls_abs_bit(pmm_bitmap, page);
         }
     }
 
+    // the bitmap sits right behind the kernel image, the memory map doesn't know about it
+    uint64_t bitmap = (uint64_t)pmm_bitmap - KERNEL_HIGH_VMA;
+    for (uint64_t page = bitmap / PAGESIZE; page < (bitmap + (pages + 7) / 8 + PAGESIZE - 1) / PAGESIZE; page++)
+        set_abs_bit(pmm_bitmap, page);
+
     TRACE("Available Memory: %uGiB\n",
             totalmem / 1073741824);
 
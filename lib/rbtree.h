@@ -134,6 +134,7 @@ static inline int rb_insert(struct rb_root_t *root, rb_comp comp,
                             void *comp_arg, struct rb_node_t *node) {
     rb_set_desc(node, 0, NULL);
     rb_set_desc(node, 1, NULL);
+    rb_set_par(node, NULL);
     if (root->root == NULL) {
         root->root = node;
         rb_set_color(root->root, RB_COLOR_BLACK);
@@ -294,4 +295,112 @@ static inline struct rb_node_t *rb_query(struct rb_root_t *root,
     return NULL;
 }
 
+static inline struct rb_node_t *rb_first(struct rb_root_t *root) {
+    struct rb_node_t *node = root->root;
+    while (rb_get_desc(node, 0) != NULL) {
+        node = rb_get_desc(node, 0);
+    }
+    return node;
+}
+
+static inline struct rb_node_t *rb_next(struct rb_node_t *node) {
+    if (rb_get_desc(node, 1) != NULL) {
+        node = rb_get_desc(node, 1);
+        while (rb_get_desc(node, 0) != NULL) {
+            node = rb_get_desc(node, 0);
+        }
+        return node;
+    }
+    while (rb_get_par(node) != NULL && rb_get_pos(node) == 1) {
+        node = rb_get_par(node);
+    }
+    return rb_get_par(node);
+}
+
+// puts new where old hangs off its parent, new may be NULL
+static inline void rb_replace(struct rb_root_t *root, struct rb_node_t *old,
+                              struct rb_node_t *new) {
+    struct rb_node_t *par = rb_get_par(old);
+    rb_set_par(new, par);
+    if (par == NULL) {
+        root->root = new;
+    } else {
+        par->desc[rb_get_desc(par, 1) == old] = new;
+    }
+}
+
+// node is NULL when the removed black node was a leaf, so its parent comes separately
+static inline void rb_erase_fix(struct rb_root_t *root, struct rb_node_t *node,
+                                struct rb_node_t *par) {
+    while (node != root->root && rb_get_color(node) == RB_COLOR_BLACK) {
+        // the sibling can't be NULL, its side has the black node we lost
+        int pos = rb_get_desc(par, 1) == node;
+        struct rb_node_t *sib = rb_get_desc(par, 1 - pos);
+        if (rb_get_color(sib) == RB_COLOR_RED) {
+            rb_set_color(sib, RB_COLOR_BLACK);
+            rb_set_color(par, RB_COLOR_RED);
+            rb_rotate(par, pos, root);
+            sib = rb_get_desc(par, 1 - pos);
+        }
+        if (rb_get_color(rb_get_desc(sib, 0)) == RB_COLOR_BLACK &&
+            rb_get_color(rb_get_desc(sib, 1)) == RB_COLOR_BLACK) {
+            rb_set_color(sib, RB_COLOR_RED);
+            node = par;
+            par = rb_get_par(node);
+            continue;
+        }
+        if (rb_get_color(rb_get_desc(sib, 1 - pos)) == RB_COLOR_BLACK) {
+            // near nephew is the red one, turn it into the far one
+            rb_set_color(rb_get_desc(sib, pos), RB_COLOR_BLACK);
+            rb_set_color(sib, RB_COLOR_RED);
+            rb_rotate(sib, 1 - pos, root);
+            sib = rb_get_desc(par, 1 - pos);
+        }
+        rb_set_color(sib, rb_get_color(par));
+        rb_set_color(par, RB_COLOR_BLACK);
+        rb_set_color(rb_get_desc(sib, 1 - pos), RB_COLOR_BLACK);
+        rb_rotate(par, pos, root);
+        node = root->root;
+    }
+    rb_set_color(node, RB_COLOR_BLACK);
+}
+
+// Unlike rb_delete, relinks the nodes themselves and frees nothing, for
+// nodes embedded in something else (rb_delete swaps their contents)
+static inline void rb_erase(struct rb_root_t *root, struct rb_node_t *node) {
+    struct rb_node_t *chld;
+    struct rb_node_t *par;
+    enum rb_color color;
+    if (rb_get_desc(node, 0) != NULL && rb_get_desc(node, 1) != NULL) {
+        // the successor moves into node's place and takes its color
+        struct rb_node_t *next = rb_get_desc(node, 1);
+        while (rb_get_desc(next, 0) != NULL) {
+            next = rb_get_desc(next, 0);
+        }
+        chld = rb_get_desc(next, 1);
+        par = rb_get_par(next);
+        color = rb_get_color(next);
+        if (par == node) {
+            par = next;
+        } else {
+            rb_set_desc(par, 0, chld);
+            rb_set_desc(next, 1, rb_get_desc(node, 1));
+        }
+        rb_set_desc(next, 0, rb_get_desc(node, 0));
+        rb_replace(root, node, next);
+        rb_set_color(next, rb_get_color(node));
+    } else {
+        chld = rb_get_desc(node, 0);
+        if (chld == NULL) {
+            chld = rb_get_desc(node, 1);
+        }
+        par = rb_get_par(node);
+        color = rb_get_color(node);
+        rb_replace(root, node, chld);
+    }
+    if (color == RB_COLOR_BLACK) {
+        rb_erase_fix(root, chld, par);
+    }
+}
+
 #endif
@@ -0,0 +1,129 @@
+#include <rcu.h>
+#include <sys/interrupts.h>
+
+/* Last grace period started, and the last one every CPU has been through */
+static volatile size_t rcu_gp;
+static volatile size_t rcu_completed;
+
+static struct rcu_cpu_t rcu_cpus[SMP_MAX_CPUS];
+
+static void rcu_advance() {
+    size_t done = __atomic_load_n(&rcu_gp, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        // Idle without a tick is quiescent for as long as it lasts
+        if (__atomic_load_n(&rcu_cpus[i].idle, __ATOMIC_SEQ_CST))
+            continue;
+
+        size_t seen = __atomic_load_n(&rcu_cpus[i].seen, __ATOMIC_ACQUIRE);
+
+        if (seen < done)
+            done = seen;
+    }
+
+    size_t completed = __atomic_load_n(&rcu_completed, __ATOMIC_RELAXED);
+
+    // Several CPUs can get here at once, only ever move it forward
+    while (completed < done &&
+            !__atomic_compare_exchange_n(&rcu_completed, &completed, done, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+// Interrupts off, or the caller could move to another CPU and report for it
+void rcu_note_qs() {
+    struct rcu_cpu_t* cpu = &rcu_cpus[smp_cpu_id()];
+    size_t gp = __atomic_load_n(&rcu_gp, __ATOMIC_SEQ_CST);
+
+    // Every read section on this CPU ended before this store
+    if (cpu->seen != gp)
+        __atomic_store_n(&cpu->seen, gp, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE) < gp)
+        rcu_advance();
+}
+
+// Whether this CPU has callbacks of its own to get through
+int rcu_needs_cpu() {
+    struct rcu_cpu_t* cpu = &rcu_cpus[smp_cpu_id()];
+
+    return cpu->next || cpu->wait;
+}
+
+// Right before halting without a tick, interrupts off
+void rcu_idle_enter() {
+    __atomic_store_n(&rcu_cpus[smp_cpu_id()].idle, 1, __ATOMIC_SEQ_CST);
+}
+
+// Pairs with the load in rcu_advance, so one of the two sees the other
+void rcu_idle_exit() {
+    struct rcu_cpu_t* cpu = &rcu_cpus[smp_cpu_id()];
+
+    if (cpu->idle)
+        __atomic_store_n(&cpu->idle, 0, __ATOMIC_SEQ_CST);
+}
+
+// From every interrupt, which may read before the idle loop gets to take it back itself
+void rcu_irq_enter() {
+    rcu_idle_exit();
+}
+
+void rcu_qs() {
+    struct rcu_head_t* done = NULL;
+    size_t flags = irq_save();
+    struct rcu_cpu_t* cpu = &rcu_cpus[smp_cpu_id()];
+
+    rcu_note_qs();
+
+    if (cpu->wait && __atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE) >= cpu->wait_gp) {
+        done = cpu->wait;
+        cpu->wait = NULL;
+        cpu->batches++;
+    }
+
+    if (!cpu->wait && cpu->next) {
+        cpu->wait = cpu->next;
+        cpu->next = NULL;
+        cpu->wait_gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+
+        // This CPU is quiescent right now, no need to wait for the next round
+        __atomic_store_n(&cpu->seen, cpu->wait_gp, __ATOMIC_SEQ_CST);
+        rcu_advance();
+    }
+
+    irq_restore(flags);
+
+    size_t cnt = 0;
+
+    for (struct rcu_head_t* next; done; done = next, cnt++) {
+        next = done->next;
+        done->fn(done);
+    }
+
+    // cpu is the one that retired the batch, we may have moved since
+    if (cnt)
+        __atomic_add_fetch(&cpu->callbacks, cnt, __ATOMIC_RELAXED);
+}
+
+void synchronize_rcu() {
+    size_t gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE) < gp) {
+        // Not in a read section, so whichever CPU we are on right now is quiescent
+        size_t flags = irq_save();
+        rcu_note_qs();
+        irq_restore(flags);
+
+        asm volatile("pause");
+    }
+}
+
+void call_rcu(struct rcu_head_t* head, void (*fn)(struct rcu_head_t*)) {
+    size_t flags = irq_save();
+    struct rcu_cpu_t* cpu = &rcu_cpus[smp_cpu_id()];
+
+    head->fn = fn;
+    head->next = cpu->next;
+    cpu->next = head;
+
+    irq_restore(flags);
+}
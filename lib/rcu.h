@@ -0,0 +1,81 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/smp.h>
+#include <proc/task.h>
+
+/**
+ * THEORY
+ * ------
+ * Quiescent state based RCU. Readers take no lock, they only promise
+ * not to pass through a quiescent state (rcu_qs) while they hold a
+ * pointer they got from rcu_dereference. A CPU passes through one each
+ * time it goes round its idle loop, switches threads or takes a timer
+ * tick outside a read section. A read section is a preempt_disable, so
+ * the scheduler can tell and never switches inside one.
+ *
+ * An updater unlinks an object with rcu_assign_pointer and then either
+ * waits in synchronize_rcu or hands it to call_rcu. A grace period is a
+ * number: it ends once every CPU has reported a quiescent state after it
+ * started, and by then nobody can still be looking at the old object.
+ * Whichever CPU reports last notices and bumps rcu_completed.
+ *
+ * call_rcu only queues on the calling CPU. Once the batch before it is
+ * done, rcu_qs moves everything queued since into a new batch behind a
+ * new grace period, so one grace period covers everything freed in
+ * between, and runs the batch from that same CPU when it is over.
+ *
+ * The scheduler only notes the quiescent state with rcu_note_qs, it can
+ * be called holding the locks a callback might want. Callbacks run from
+ * rcu_qs: in the idle loop, and from the tick whenever it lands on code
+ * holding no lock at all, which is also the only time it counts as a
+ * quiescent state. A CPU that never idles still gets through its
+ * batches that way.
+ *
+ * A CPU that stops its tick to idle can't report anything, so it marks
+ * itself idle instead (rcu_idle_enter) and grace periods go on without
+ * it. The first interrupt to wake it takes that back (rcu_irq_enter),
+ * before the handler can read anything, or the idle loop does if it
+ * wakes without one (rcu_idle_exit). A CPU with callbacks queued has
+ * to keep its tick (rcu_needs_cpu), nothing else would run them.
+ * synchronize_rcu may not be called from an interrupt, whatever it
+ * interrupted could be inside a read section.
+ */
+
+struct rcu_head_t {
+    struct rcu_head_t* next;
+    void (*fn)(struct rcu_head_t*);
+};
+
+struct rcu_cpu_t {
+    volatile size_t seen;
+    volatile int idle;
+
+    struct rcu_head_t* next;
+    struct rcu_head_t* wait;
+    size_t wait_gp;
+
+    size_t batches;
+    size_t callbacks;
+} __attribute__((aligned(64)));
+
+#define rcu_read_lock()             preempt_disable()
+#define rcu_read_unlock()           preempt_enable()
+
+#define rcu_dereference(p)          __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_qs();
+void rcu_note_qs();
+
+int rcu_needs_cpu();
+void rcu_idle_enter();
+void rcu_idle_exit();
+void rcu_irq_enter();
+
+void synchronize_rcu();
+void call_rcu(struct rcu_head_t* head, void (*fn)(struct rcu_head_t*));
+
+#endif
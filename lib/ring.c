@@ -0,0 +1,150 @@
+#include <ring.h>
+#include <atomic.h>
+
+int spsc_init(struct spsc_ring_t* ring, void** slots, size_t size) {
+    if (!size || (size & (size - 1)))
+        return 0;
+
+    ring->head = 0;
+    ring->tail_cache = 0;
+    ring->tail = 0;
+    ring->head_cache = 0;
+    ring->slots = slots;
+    ring->mask = size - 1;
+
+    return 1;
+}
+
+size_t spsc_enqueue(struct spsc_ring_t* ring, void** items, size_t n) {
+    size_t head = ring->head;
+    size_t size = ring->mask + 1;
+
+    if (size - (head - ring->tail_cache) < n)
+        ring->tail_cache = smp_load_acquire(&ring->tail);
+
+    size_t space = size - (head - ring->tail_cache);
+
+    if (n > space)
+        n = space;
+
+    for (size_t i = 0; i < n; i++)
+        ring->slots[(head + i) & ring->mask] = items[i];
+
+    smp_store_release(&ring->head, head + n);
+    return n;
+}
+
+size_t spsc_dequeue(struct spsc_ring_t* ring, void** items, size_t n) {
+    size_t tail = ring->tail;
+
+    if (ring->head_cache - tail < n)
+        ring->head_cache = smp_load_acquire(&ring->head);
+
+    size_t avail = ring->head_cache - tail;
+
+    if (n > avail)
+        n = avail;
+
+    for (size_t i = 0; i < n; i++)
+        items[i] = ring->slots[(tail + i) & ring->mask];
+
+    smp_store_release(&ring->tail, tail + n);
+    return n;
+}
+
+// Only exact when called from the producer or consumer, a hint otherwise
+size_t spsc_count(struct spsc_ring_t* ring) {
+    return smp_load_acquire(&ring->head) - smp_load_acquire(&ring->tail);
+}
+
+int mpmc_init(struct mpmc_ring_t* ring, struct mpmc_cell_t* cells, size_t size) {
+    if (!size || (size & (size - 1)))
+        return 0;
+
+    for (size_t i = 0; i < size; i++) {
+        cells[i].seq = i;
+        cells[i].data = NULL;
+    }
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->cells = cells;
+    ring->mask = size - 1;
+
+    return 1;
+}
+
+/*
+ * Claims up to n positions from *index on whose cells have sequence
+ * position + ready, and returns the first in *pos. Once a cell is ready
+ * for a position only whoever claims that position changes it again, and
+ * the index only counts up, so if the CAS finds it unchanged the run we
+ * checked is still ready and ours.
+ */
+static size_t mpmc_claim(struct mpmc_ring_t* ring, volatile size_t* index, size_t ready, size_t n, size_t* pos) {
+    size_t cur = READ_ONCE(*index);
+
+    for (;;) {
+        size_t k = 0;
+
+        while (k < n) {
+            struct mpmc_cell_t* cell = &ring->cells[(cur + k) & ring->mask];
+            intptr_t diff = (intptr_t)(smp_load_acquire(&cell->seq) - (cur + k + ready));
+
+            if (diff)
+                break;
+
+            k++;
+        }
+
+        if (!k) {
+            size_t now = READ_ONCE(*index);
+
+            // Still our turn and the cell isn't ready: full or empty
+            if (now == cur)
+                return 0;
+
+            cur = now;
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(index, &cur, cur + k, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *pos = cur;
+            return k;
+        }
+
+        cpu_relax();
+    }
+}
+
+size_t mpmc_enqueue(struct mpmc_ring_t* ring, void** items, size_t n) {
+    size_t pos;
+
+    if (!n || !(n = mpmc_claim(ring, &ring->head, 0, n, &pos)))
+        return 0;
+
+    for (size_t i = 0; i < n; i++) {
+        struct mpmc_cell_t* cell = &ring->cells[(pos + i) & ring->mask];
+
+        cell->data = items[i];
+        smp_store_release(&cell->seq, pos + i + 1);
+    }
+
+    return n;
+}
+
+size_t mpmc_dequeue(struct mpmc_ring_t* ring, void** items, size_t n) {
+    size_t pos;
+
+    if (!n || !(n = mpmc_claim(ring, &ring->tail, 1, n, &pos)))
+        return 0;
+
+    for (size_t i = 0; i < n; i++) {
+        struct mpmc_cell_t* cell = &ring->cells[(pos + i) & ring->mask];
+
+        items[i] = cell->data;
+        smp_store_release(&cell->seq, pos + i + ring->mask + 1);
+    }
+
+    return n;
+}
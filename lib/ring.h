@@ -0,0 +1,71 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * THEORY
+ * ------
+ * Bounded rings of pointers over a caller supplied array whose size is a
+ * power of two. Positions only ever count up and are masked on use, so
+ * head - tail is the fill level without any wrap handling.
+ *
+ * spsc_ring_t has one producer and one consumer and is wait-free: each
+ * side owns its index and only publishes it, with release, once the
+ * slots are written or read. Each side also caches the other's index
+ * and only goes and reads the real one (a cache miss on the other
+ * side's line) when the cached value says the ring is full or empty.
+ * The producer's and the consumer's halves sit on lines of their own.
+ *
+ * mpmc_ring_t is Vyukov's bounded queue. Every cell carries a sequence
+ * number saying whose turn it is. A cell at position p is free for the
+ * producer of round p when its sequence is p and holds data for the
+ * consumer of round p when it is p + 1. Claiming positions is a CAS on
+ * head or tail, then the cells are filled or emptied without any
+ * contention and handed on by bumping their sequence. It is lock-free,
+ * not wait-free: a claimer preempted between its CAS and its sequence
+ * store holds up whoever comes round to that cell next.
+ *
+ * All four calls take a batch and return how many items went through,
+ * from 0 (full or empty) up to n. A batch claims its positions with one
+ * index update, which is where the batching pays.
+ */
+
+struct spsc_ring_t {
+    // Producer's line
+    volatile size_t head;
+    size_t tail_cache;
+
+    // Consumer's line
+    volatile size_t tail __attribute__((aligned(64)));
+    size_t head_cache;
+
+    // Read-only after init
+    void** slots __attribute__((aligned(64)));
+    size_t mask;
+};
+
+struct mpmc_cell_t {
+    volatile size_t seq;
+    void* data;
+};
+
+struct mpmc_ring_t {
+    volatile size_t head;
+    volatile size_t tail __attribute__((aligned(64)));
+
+    struct mpmc_cell_t* cells __attribute__((aligned(64)));
+    size_t mask;
+};
+
+int spsc_init(struct spsc_ring_t* ring, void** slots, size_t size);
+size_t spsc_enqueue(struct spsc_ring_t* ring, void** items, size_t n);
+size_t spsc_dequeue(struct spsc_ring_t* ring, void** items, size_t n);
+size_t spsc_count(struct spsc_ring_t* ring);
+
+int mpmc_init(struct mpmc_ring_t* ring, struct mpmc_cell_t* cells, size_t size);
+size_t mpmc_enqueue(struct mpmc_ring_t* ring, void** items, size_t n);
+size_t mpmc_dequeue(struct mpmc_ring_t* ring, void** items, size_t n);
+
+#endif
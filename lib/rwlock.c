@@ -0,0 +1,96 @@
+#include <rwlock.h>
+#include <proc/task.h>
+
+void read_lock(rwlock_t* lock) {
+    preempt_disable();
+
+    for (;;) {
+        uint64_t v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+        if (v & (RWLOCK_WRITER | RWLOCK_WAITING)) {
+            asm volatile("pause");
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(lock, &v, v + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+void read_release(rwlock_t* lock) {
+    __atomic_sub_fetch(lock, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+void write_lock(rwlock_t* lock) {
+    preempt_disable();
+
+    for (;;) {
+        uint64_t v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+        if (!(v & (RWLOCK_WRITER | RWLOCK_READERS))) {
+            // Taking it clears RWLOCK_WAITING, anyone else still queued sets it again
+            if (__atomic_compare_exchange_n(lock, &v, RWLOCK_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+
+            continue;
+        }
+
+        if (!(v & RWLOCK_WAITING))
+            __atomic_or_fetch(lock, RWLOCK_WAITING, __ATOMIC_RELAXED);
+
+        asm volatile("pause");
+    }
+}
+
+void write_release(rwlock_t* lock) {
+    __atomic_and_fetch(lock, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+void percpu_read_lock(percpu_rwlock_t* lock) {
+    // Also keeps us on this CPU's count until the release
+    preempt_disable();
+
+    volatile int64_t* readers = &lock->cpus[smp_cpu_id()].readers;
+
+    for (;;) {
+        // Pairs with the store in percpu_write_lock, one of the two sees the other
+        __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))
+            return;
+
+        __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED))
+            asm volatile("pause");
+    }
+}
+
+void percpu_read_release(percpu_rwlock_t* lock) {
+    __atomic_sub_fetch(&lock->cpus[smp_cpu_id()].readers, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+void percpu_write_lock(percpu_rwlock_t* lock) {
+    spinlock_lock(&lock->writers);
+    __atomic_store_n(&lock->writer, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        int64_t readers = 0;
+
+        for (size_t i = 0; i < SMP_MAX_CPUS; i++)
+            readers += __atomic_load_n(&lock->cpus[i].readers, __ATOMIC_ACQUIRE);
+
+        if (!readers)
+            return;
+
+        asm volatile("pause");
+    }
+}
+
+void percpu_write_release(percpu_rwlock_t* lock) {
+    __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+    spinlock_release(&lock->writers);
+}
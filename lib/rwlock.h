@@ -0,0 +1,41 @@
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <locks.h>
+#include <sys/smp.h>
+
+/**
+ * THEORY
+ * ------
+ * Every rwlock_t reader still writes the lock word, and on a hot lookup
+ * path that shared line is the whole cost. percpu_rwlock_t gives each
+ * CPU a reader count on a line of its own: a reader bumps its count and
+ * backs off if it then sees a writer, a writer raises its flag and waits
+ * for the counts to add up to zero. Reading stays on the local cache,
+ * writing walks every CPU and the lock is SMP_MAX_CPUS lines big, so it
+ * is only worth it for a few hot global tables.
+ *
+ * Like rwlock_t it prefers writers, with the same rule about nesting,
+ * and both sides hold preemption off. A reader switched out on a CPU
+ * whose writer then spins for the counts to drain would never get back.
+ */
+
+struct percpu_rwlock_cpu_t {
+    volatile int64_t readers;
+} __attribute__((aligned(64)));
+
+typedef struct {
+    volatile uint64_t writer;
+    spinlock_t writers;
+
+    struct percpu_rwlock_cpu_t cpus[SMP_MAX_CPUS];
+} percpu_rwlock_t;
+
+void percpu_read_lock(percpu_rwlock_t* lock);
+void percpu_read_release(percpu_rwlock_t* lock);
+void percpu_write_lock(percpu_rwlock_t* lock);
+void percpu_write_release(percpu_rwlock_t* lock);
+
+#endif
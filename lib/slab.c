@@ -0,0 +1,844 @@
+#include <slab.h>
+#include <mem.h>
+#include <trace.h>
+#include <mm/pmm.h>
+#include <sys/smp.h>
+#include <sys/interrupts.h>
+
+#undef __MODULE__
+#define __MODULE__ "slab"
+
+/**
+ * THEORY
+ * ------
+ * Every allocation is served from a kmem cache. A cache owns a list
+ * of slabs, a slab being a run of pages straight from the pmm with a
+ * struct slab_t at the front and equally sized objects after it. Free
+ * objects are chained through a link word, so alloc and free are a
+ * list push/pop. kmalloc is backed by a fixed set of size class
+ * caches (kmalloc-16 .. kmalloc-4096), kernel structures that are
+ * allocated often get a typed cache of their own.
+ *
+ * Objects carry no header. Every page of a slab is recorded in
+ * slab_map (indexed by page frame), so the owning slab, and with it
+ * the cache and object size, is found from the pointer alone.
+ *
+ * Every size class is aligned to the largest power of two dividing
+ * its size. The 64 byte slab header costs a slot either way, so this
+ * is free, and aligned requests are served by picking a class that is
+ * aligned enough. The smallest class is 16 bytes, so kmalloc keeps
+ * liballoc's 16 byte alignment whichever of the two serves it.
+ * Anything above a page goes straight to the pmm with an off-page
+ * descriptor in slab_map. Those blocks resize in place by handing
+ * their tail back or claiming the free pages right behind them.
+ *
+ * Caches with a constructor run it once per object when the slab is
+ * created, and objects are expected to be freed back in their
+ * constructed state. Their link word lives past the object so a free
+ * doesn't clobber it. A constructor runs under the cache lock with
+ * interrupts off and slabs are released without a destructor, so it
+ * may only initialize the object: no allocations, no locks.
+ *
+ * In front of the slab layer every CPU keeps two magazines per
+ * cache (Bonwick style). Alloc and free pop/push the loaded
+ * magazine with interrupts off and no locking; only when both
+ * magazines are exhausted (or full) is one traded with the cache
+ * depot, which is the only shared state on the fast path.
+ *
+ * A slab belongs to the CPU that last allocated from it. An object
+ * freed on another CPU is pushed onto its slab's own remote list with
+ * a single CAS instead of going through a magazine, so a consumer
+ * freeing what a producer allocated never takes a lock. Whoever next
+ * holds the cache lock for that slab takes the whole list with one
+ * exchange and puts it back on the freelist: when the slab is about to
+ * hand out an object or take one back, before the cache would grow
+ * (then every full slab is checked) and when it is trimmed. Objects
+ * on a remote list still count as in use until then.
+ *
+ * Slabs that empty out stay on their cache's empty list so churn never
+ * reaches the pmm. slab_trim gives memory back lazily: it first frees
+ * the depot magazines that weren't touched since the last trim (the
+ * lowest the depot count dropped to is the part of it nobody needed),
+ * then releases empty slabs until no more than the requested amount
+ * is left idle. It locks one cache at a time, so an allocation that
+ * runs out of pages only trims and retries once it holds no lock, and
+ * a trim from inside a constructor does nothing.
+ */
+
+#define SLAB_PHYS(ptr) \
+    ((uintptr_t)(ptr) >= HIGH_VMA ? (uintptr_t)(ptr) - HIGH_VMA : (uintptr_t)(ptr))
+
+#define SLAB_ALIGN_UP(n, align) (((n) + (align) - 1) & ~((align) - 1))
+
+#define SLAB_LINK(cache, obj) (*(void **)((uint8_t *)(obj) + (cache)->link))
+
+static const size_t kmalloc_sizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+static const char* kmalloc_names[SLAB_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64",
+    "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256", "kmalloc-384",
+    "kmalloc-512", "kmalloc-768", "kmalloc-1024", "kmalloc-1536", "kmalloc-2048",
+    "kmalloc-3072", "kmalloc-4096"
+};
+
+static struct kmem_cache_t kmalloc_caches[SLAB_CLASSES];
+static uint8_t kmalloc_index[SLAB_MAX_SIZE / SLAB_MIN_SIZE + 1];
+
+static struct kmem_cache_t kmem_cache_cache;
+static struct kmem_cache_t slab_mag_cache;
+static struct kmem_cache_t slab_large_cache;
+
+static size_t slab_large_allocs;
+static size_t slab_large_pages;
+
+static size_t slab_empty_pages;
+
+static struct kmem_cache_t* kmem_caches;
+static spinlock_t kmem_caches_lock;
+
+static struct slab_t** slab_map;
+static size_t slab_map_entries;
+
+/* Nonzero while the CPU runs a constructor, with some cache locked */
+static uint8_t slab_in_ctor[SMP_MAX_CPUS];
+
+static void slab_list_rm(struct slab_t** list, struct slab_t* slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static void slab_list_add(struct slab_t** list, struct slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+
+    if (*list)
+        (*list)->prev = slab;
+
+    *list = slab;
+}
+
+static struct slab_t* slab_lookup(void* ptr) {
+    size_t pfn = SLAB_PHYS(ptr) / PAGESIZE;
+
+    if (!slab_map || pfn >= slab_map_entries)
+        return NULL;
+
+    return slab_map[pfn];
+}
+
+static struct slab_t* slab_grow(struct kmem_cache_t* cache) {
+    struct slab_t* slab = pmm_alloc(cache->pages);
+
+    if (!slab)
+        return NULL;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->cache = cache;
+    slab->base = slab;
+    slab->inuse = 0;
+    slab->pages = cache->pages;
+    slab->owner = smp_cpu_id();
+    slab->freelist = NULL;
+    slab->remote = NULL;
+
+    // Chain the objects back to front so the freelist hands them out in order
+    uint8_t* objs = (uint8_t *)slab + cache->offset;
+    slab_in_ctor[smp_cpu_id()] = cache->ctor != NULL;
+
+    for (size_t i = cache->objs; i > 0; i--) {
+        void* obj = objs + (i - 1) * cache->stride;
+
+        if (cache->ctor)
+            cache->ctor(obj);
+
+        SLAB_LINK(cache, obj) = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    slab_in_ctor[smp_cpu_id()] = 0;
+
+    size_t pfn = SLAB_PHYS(slab) / PAGESIZE;
+    for (size_t i = 0; i < slab->pages; i++)
+        slab_map[pfn + i] = slab;
+
+    cache->slabs++;
+
+    return slab;
+}
+
+static void slab_release(struct kmem_cache_t* cache, struct slab_t* slab) {
+    size_t pfn = SLAB_PHYS(slab) / PAGESIZE;
+    for (size_t i = 0; i < slab->pages; i++)
+        slab_map[pfn + i] = NULL;
+
+    cache->slabs--;
+
+    pmm_free(slab, slab->pages);
+}
+
+/* Puts what other CPUs freed into slab back on its freelist, with the cache locked */
+static void slab_remote_drain(struct kmem_cache_t* cache, struct slab_t* slab) {
+    if (!__atomic_load_n(&slab->remote, __ATOMIC_RELAXED))
+        return;
+
+    // Only ever taken as a whole, so the pushers can't suffer from ABA
+    void* head = __atomic_exchange_n(&slab->remote, NULL, __ATOMIC_ACQUIRE);
+    void* tail = head;
+    size_t cnt = 1;
+
+    for (; SLAB_LINK(cache, tail); tail = SLAB_LINK(cache, tail))
+        cnt++;
+
+    slab_list_rm(slab->freelist ? &cache->partial : &cache->full, slab);
+
+    SLAB_LINK(cache, tail) = slab->freelist;
+    slab->freelist = head;
+    slab->inuse -= cnt;
+    cache->inuse -= cnt;
+
+    if (slab->inuse) {
+        slab_list_add(&cache->partial, slab);
+    } else {
+        slab_list_add(&cache->empty, slab);
+        __atomic_add_fetch(&slab_empty_pages, slab->pages, __ATOMIC_RELAXED);
+    }
+}
+
+static void slab_remote_drain_list(struct kmem_cache_t* cache, struct slab_t* list) {
+    // Draining moves the slab to another list, so walk with the next one in hand
+    for (struct slab_t* next; list; list = next) {
+        next = list->next;
+        slab_remote_drain(cache, list);
+    }
+}
+
+static void* slab_cache_alloc(struct kmem_cache_t* cache) {
+    spinlock_lock(&cache->lock);
+
+    if (cache->partial)
+        slab_remote_drain(cache, cache->partial);
+
+    // Better to take back what was freed remotely than to grow
+    if (!cache->partial && !cache->empty)
+        slab_remote_drain_list(cache, cache->full);
+
+    struct slab_t* slab = cache->partial;
+
+    if (!slab) {
+        if (cache->empty) {
+            slab = cache->empty;
+            slab_list_rm(&cache->empty, slab);
+            __atomic_sub_fetch(&slab_empty_pages, slab->pages, __ATOMIC_RELAXED);
+        } else if (!(slab = slab_grow(cache))) {
+            spinlock_release(&cache->lock);
+            return NULL;
+        }
+
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void* obj = slab->freelist;
+    slab->freelist = SLAB_LINK(cache, obj);
+    slab->inuse++;
+    cache->inuse++;
+
+    // Read without the lock by whoever frees into it
+    __atomic_store_n(&slab->owner, smp_cpu_id(), __ATOMIC_RELAXED);
+
+    if (!slab->freelist) {
+        slab_list_rm(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    spinlock_release(&cache->lock);
+    return obj;
+}
+
+static void slab_cache_free(struct kmem_cache_t* cache, struct slab_t* slab, void* obj) {
+    spinlock_lock(&cache->lock);
+
+    slab_remote_drain(cache, slab);
+
+    if (!slab->freelist) {
+        slab_list_rm(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    SLAB_LINK(cache, obj) = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->inuse--;
+
+    // Empty slabs are only handed back to the pmm by slab_trim
+    if (!slab->inuse) {
+        slab_list_rm(&cache->partial, slab);
+        slab_list_add(&cache->empty, slab);
+        __atomic_add_fetch(&slab_empty_pages, slab->pages, __ATOMIC_RELAXED);
+    }
+
+    spinlock_release(&cache->lock);
+}
+
+static void slab_remote_push(struct kmem_cache_t* cache, struct slab_t* slab, void* obj) {
+    void* head = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+
+    do {
+        SLAB_LINK(cache, obj) = head;
+    } while (!__atomic_compare_exchange_n(&slab->remote, &head, obj, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void* slab_mag_pop(struct kmem_cache_t* cache, struct slab_cpu_t* cpu) {
+    if (cpu->loaded && cpu->loaded->rounds)
+        return cpu->loaded->objs[--cpu->loaded->rounds];
+
+    if (cpu->prev && cpu->prev->rounds) {
+        struct slab_mag_t* tmp = cpu->loaded;
+        cpu->loaded = cpu->prev;
+        cpu->prev = tmp;
+
+        return cpu->loaded->objs[--cpu->loaded->rounds];
+    }
+
+    // Both are empty, trade the previous one for a full one from the depot
+    spinlock_lock(&cache->depot_lock);
+
+    struct slab_mag_t* full = cache->depot_full;
+
+    if (full) {
+        cache->depot_full = full->next;
+        cache->depot_full_cnt--;
+
+        if (cache->depot_full_cnt < cache->depot_full_min)
+            cache->depot_full_min = cache->depot_full_cnt;
+
+        if (cpu->prev) {
+            cpu->prev->next = cache->depot_empty;
+            cache->depot_empty = cpu->prev;
+            cache->depot_empty_cnt++;
+        }
+
+        cpu->prev = cpu->loaded;
+        cpu->loaded = full;
+    }
+
+    spinlock_release(&cache->depot_lock);
+
+    if (!full)
+        return NULL;
+
+    return cpu->loaded->objs[--cpu->loaded->rounds];
+}
+
+static int slab_mag_push(struct kmem_cache_t* cache, struct slab_cpu_t* cpu, void* obj) {
+    if (cpu->loaded && cpu->loaded->rounds < SLAB_MAG_ROUNDS) {
+        cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+        return 1;
+    }
+
+    if (cpu->prev && !cpu->prev->rounds) {
+        struct slab_mag_t* tmp = cpu->loaded;
+        cpu->loaded = cpu->prev;
+        cpu->prev = tmp;
+
+        cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+        return 1;
+    }
+
+    // Both are full, hand the previous one to the depot for an empty one
+    spinlock_lock(&cache->depot_lock);
+
+    struct slab_mag_t* empty = cache->depot_empty;
+
+    if (empty) {
+        cache->depot_empty = empty->next;
+        cache->depot_empty_cnt--;
+
+        if (cache->depot_empty_cnt < cache->depot_empty_min)
+            cache->depot_empty_min = cache->depot_empty_cnt;
+    }
+
+    spinlock_release(&cache->depot_lock);
+
+    if (!empty) {
+        empty = slab_cache_alloc(&slab_mag_cache);
+
+        if (!empty)
+            return 0;
+    }
+
+    empty->rounds = 0;
+
+    if (cpu->prev) {
+        spinlock_lock(&cache->depot_lock);
+
+        cpu->prev->next = cache->depot_full;
+        cache->depot_full = cpu->prev;
+        cache->depot_full_cnt++;
+
+        spinlock_release(&cache->depot_lock);
+    }
+
+    cpu->prev = cpu->loaded;
+    cpu->loaded = empty;
+
+    cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+    return 1;
+}
+
+static void kmem_cache_setup(struct kmem_cache_t* cache, const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    memset(cache, 0, sizeof(struct kmem_cache_t));
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+
+    if (ctor) {
+        cache->link = SLAB_ALIGN_UP(size, sizeof(void *));
+        cache->stride = SLAB_ALIGN_UP(cache->link + sizeof(void *), align);
+    } else {
+        cache->link = 0;
+        cache->stride = SLAB_ALIGN_UP(size < sizeof(void *) ? sizeof(void *) : size, align);
+    }
+
+    cache->offset = SLAB_ALIGN_UP(sizeof(struct slab_t), align);
+    cache->pages = (cache->offset + SLAB_MIN_OBJS * cache->stride + PAGESIZE - 1) / PAGESIZE;
+    cache->objs = (cache->pages * PAGESIZE - cache->offset) / cache->stride;
+}
+
+struct kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (!size || (align & (align - 1)) || align > PAGESIZE) {
+        WARN("Refusing cache %s (size %lu, align %lu)\n", name, size, align);
+        return NULL;
+    }
+
+    struct kmem_cache_t* cache = kmem_cache_alloc(&kmem_cache_cache);
+
+    if (!cache)
+        return NULL;
+
+    kmem_cache_setup(cache, name, size, align, ctor);
+
+    // Caches are never destroyed, so once published the list can be walked without the lock
+    spinlock_lock(&kmem_caches_lock);
+    cache->next = kmem_caches;
+    __atomic_store_n(&kmem_caches, cache, __ATOMIC_RELEASE);
+    spinlock_release(&kmem_caches_lock);
+
+    return cache;
+}
+
+void* kmem_cache_alloc(struct kmem_cache_t* cache) {
+    if (!slab_map || !cache)
+        return NULL;
+
+    size_t flags = irq_save();
+
+    struct slab_cpu_t* cpu = &cache->cpus[smp_cpu_id()];
+    void* obj = slab_mag_pop(cache, cpu);
+
+    if (!obj)
+        obj = slab_cache_alloc(cache);
+
+    if (obj)
+        cpu->allocs++;
+
+    irq_restore(flags);
+
+    // Out of pages, give back whatever the caches hold idle and retry once
+    if (!obj && slab_trim(0)) {
+        flags = irq_save();
+
+        if ((obj = slab_cache_alloc(cache)))
+            cache->cpus[smp_cpu_id()].allocs++;
+
+        irq_restore(flags);
+    }
+
+    return obj;
+}
+
+static void kmem_cache_free_slab(struct kmem_cache_t* cache, struct slab_t* slab, void* ptr) {
+    void* obj = (void *)SLAB_PHYS(ptr);
+    uintptr_t first = (uintptr_t)slab + cache->offset;
+
+    if ((uintptr_t)obj < first
+            || ((uintptr_t)obj - first) % cache->stride
+            || ((uintptr_t)obj - first) / cache->stride >= cache->objs) {
+        WARN("Bad free of %#lx (%s, slab %#lx)\n", (uintptr_t)ptr, cache->name, (uintptr_t)slab);
+        return;
+    }
+
+    size_t flags = irq_save();
+
+    size_t id = smp_cpu_id();
+    struct slab_cpu_t* cpu = &cache->cpus[id];
+
+    if (__atomic_load_n(&slab->owner, __ATOMIC_RELAXED) != id) {
+        slab_remote_push(cache, slab, obj);
+        cpu->remote_frees++;
+    } else if (!slab_mag_push(cache, cpu, obj)) {
+        slab_cache_free(cache, slab, obj);
+    }
+
+    cpu->frees++;
+
+    irq_restore(flags);
+}
+
+void kmem_cache_free(struct kmem_cache_t* cache, void* ptr) {
+    if (!ptr)
+        return;
+
+    struct slab_t* slab = slab_lookup(ptr);
+
+    if (!slab || slab->cache != cache) {
+        WARN("Free of %#lx into %s, which doesn't own it\n", (uintptr_t)ptr, cache->name);
+        return;
+    }
+
+    kmem_cache_free_slab(cache, slab, ptr);
+}
+
+static void* slab_alloc_pages(size_t pages, size_t align) {
+    struct slab_t* slab = kmem_cache_alloc(&slab_large_cache);
+
+    if (!slab)
+        return NULL;
+
+    void* base = pmm_alloc_aligned(pages, align > PAGESIZE ? align / PAGESIZE : 1);
+
+    if (!base) {
+        kmem_cache_free(&slab_large_cache, slab);
+        return NULL;
+    }
+
+    slab->cache = NULL;
+    slab->base = base;
+    slab->pages = pages;
+
+    size_t pfn = SLAB_PHYS(base) / PAGESIZE;
+    for (size_t i = 0; i < pages; i++)
+        slab_map[pfn + i] = slab;
+
+    __atomic_add_fetch(&slab_large_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slab_large_pages, pages, __ATOMIC_RELAXED);
+
+    return base;
+}
+
+static void slab_free_pages(struct slab_t* slab, void* ptr) {
+    if (SLAB_PHYS(ptr) != SLAB_PHYS(slab->base)) {
+        WARN("Bad free of %#lx (%lu pages at %#lx)\n", (uintptr_t)ptr, slab->pages, (uintptr_t)slab->base);
+        return;
+    }
+
+    size_t pfn = SLAB_PHYS(slab->base) / PAGESIZE;
+    for (size_t i = 0; i < slab->pages; i++)
+        slab_map[pfn + i] = NULL;
+
+    __atomic_sub_fetch(&slab_large_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&slab_large_pages, slab->pages, __ATOMIC_RELAXED);
+
+    pmm_free(slab->base, slab->pages);
+    kmem_cache_free(&slab_large_cache, slab);
+}
+
+void* slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE)
+        return NULL;
+
+    if (size < SLAB_MIN_SIZE)
+        size = SLAB_MIN_SIZE;
+
+    return kmem_cache_alloc(&kmalloc_caches[kmalloc_index[(size + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE]]);
+}
+
+void* slab_alloc_aligned(size_t size, size_t align) {
+    if (!slab_map || !align || (align & (align - 1)))
+        return NULL;
+
+    if (size < SLAB_MIN_SIZE)
+        size = SLAB_MIN_SIZE;
+
+    // kmalloc-4096 is page aligned, so this only fails for huge alignments
+    if (size <= SLAB_MAX_SIZE) {
+        for (size_t i = kmalloc_index[(size + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE]; i < SLAB_CLASSES; i++) {
+            if (kmalloc_caches[i].align >= align)
+                return kmem_cache_alloc(&kmalloc_caches[i]);
+        }
+    }
+
+    return slab_alloc_pages((size + PAGESIZE - 1) / PAGESIZE, align);
+}
+
+int slab_free(void* ptr) {
+    struct slab_t* slab = slab_lookup(ptr);
+
+    if (!slab)
+        return 0;
+
+    if (!slab->cache)
+        slab_free_pages(slab, ptr);
+    else
+        kmem_cache_free_slab(slab->cache, slab, ptr);
+
+    return 1;
+}
+
+/* Grows or shrinks a page-granular block without moving it, 0 if it can't */
+int slab_resize(void* ptr, size_t size) {
+    struct slab_t* slab = slab_lookup(ptr);
+    size_t pages = (size + PAGESIZE - 1) / PAGESIZE;
+
+    if (!slab || slab->cache || !pages || SLAB_PHYS(ptr) != SLAB_PHYS(slab->base))
+        return 0;
+
+    size_t pfn = SLAB_PHYS(slab->base) / PAGESIZE;
+
+    if (pages < slab->pages) {
+        for (size_t i = pages; i < slab->pages; i++)
+            slab_map[pfn + i] = NULL;
+
+        pmm_free((void *)((pfn + pages) * PAGESIZE), slab->pages - pages);
+        __atomic_sub_fetch(&slab_large_pages, slab->pages - pages, __ATOMIC_RELAXED);
+    } else if (pages > slab->pages) {
+        if (pfn + pages > slab_map_entries
+                || !pmm_claim((void *)((pfn + slab->pages) * PAGESIZE), pages - slab->pages))
+            return 0;
+
+        for (size_t i = slab->pages; i < pages; i++)
+            slab_map[pfn + i] = slab;
+
+        __atomic_add_fetch(&slab_large_pages, pages - slab->pages, __ATOMIC_RELAXED);
+    }
+
+    slab->pages = pages;
+
+    return 1;
+}
+
+size_t slab_size(void* ptr) {
+    struct slab_t* slab = slab_lookup(ptr);
+
+    if (!slab)
+        return 0;
+
+    if (!slab->cache)
+        return slab->pages * PAGESIZE;
+
+    return slab->cache->size;
+}
+
+/**
+ * Pass 0 frees the depot magazines that went unused since the last trim
+ * (every one of them if keep_pages is 0) back into their slabs, pass 1
+ * releases empty slabs while more than keep_pages sit idle.
+ */
+static size_t kmem_cache_trim(struct kmem_cache_t* cache, size_t keep_pages, int pass) {
+    size_t released = 0;
+    size_t flags = irq_save();
+
+    if (pass == 0) {
+        struct slab_mag_t* full = NULL;
+        struct slab_mag_t* empty = NULL;
+
+        spinlock_lock(&cache->depot_lock);
+
+        size_t full_cnt = keep_pages ? cache->depot_full_min : cache->depot_full_cnt;
+        size_t empty_cnt = keep_pages ? cache->depot_empty_min : cache->depot_empty_cnt;
+
+        for (size_t i = 0; i < full_cnt; i++) {
+            struct slab_mag_t* mag = cache->depot_full;
+            cache->depot_full = mag->next;
+            mag->next = full;
+            full = mag;
+        }
+
+        for (size_t i = 0; i < empty_cnt; i++) {
+            struct slab_mag_t* mag = cache->depot_empty;
+            cache->depot_empty = mag->next;
+            mag->next = empty;
+            empty = mag;
+        }
+
+        cache->depot_full_cnt -= full_cnt;
+        cache->depot_empty_cnt -= empty_cnt;
+        cache->depot_full_min = cache->depot_full_cnt;
+        cache->depot_empty_min = cache->depot_empty_cnt;
+
+        spinlock_release(&cache->depot_lock);
+
+        while (full) {
+            struct slab_mag_t* next = full->next;
+
+            for (size_t i = 0; i < full->rounds; i++)
+                slab_cache_free(cache, slab_lookup(full->objs[i]), full->objs[i]);
+
+            full->next = empty;
+            empty = full;
+            full = next;
+        }
+
+        // Magazines never go through a magazine layer of their own
+        while (empty) {
+            struct slab_mag_t* next = empty->next;
+            slab_cache_free(&slab_mag_cache, slab_lookup(empty), empty);
+            empty = next;
+        }
+    } else {
+        spinlock_lock(&cache->lock);
+
+        slab_remote_drain_list(cache, cache->full);
+        slab_remote_drain_list(cache, cache->partial);
+
+        while (cache->empty && __atomic_load_n(&slab_empty_pages, __ATOMIC_RELAXED) > keep_pages) {
+            struct slab_t* slab = cache->empty;
+
+            slab_list_rm(&cache->empty, slab);
+            __atomic_sub_fetch(&slab_empty_pages, slab->pages, __ATOMIC_RELAXED);
+
+            released += slab->pages;
+            slab_release(cache, slab);
+        }
+
+        spinlock_release(&cache->lock);
+    }
+
+    irq_restore(flags);
+
+    return released;
+}
+
+size_t slab_trim(size_t keep) {
+    size_t keep_pages = keep / PAGESIZE;
+    size_t released = 0;
+
+    if (!slab_map)
+        return 0;
+
+    // A constructor that allocates would find its own cache locked
+    size_t flags = irq_save();
+    int nested = slab_in_ctor[smp_cpu_id()];
+    irq_restore(flags);
+
+    if (nested)
+        return 0;
+
+    // Interrupts go off one cache at a time, never across the whole walk.
+    // Reap everything first, the magazines freed in pass 0 empty out slabs of their own
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < SLAB_CLASSES; i++)
+            released += kmem_cache_trim(&kmalloc_caches[i], keep_pages, pass);
+
+        released += kmem_cache_trim(&kmem_cache_cache, keep_pages, pass);
+        released += kmem_cache_trim(&slab_large_cache, keep_pages, pass);
+
+        for (struct kmem_cache_t* cache = __atomic_load_n(&kmem_caches, __ATOMIC_ACQUIRE); cache; cache = cache->next)
+            released += kmem_cache_trim(cache, keep_pages, pass);
+
+        released += kmem_cache_trim(&slab_mag_cache, keep_pages, pass);
+    }
+
+    return released * PAGESIZE;
+}
+
+size_t slab_idle() {
+    return __atomic_load_n(&slab_empty_pages, __ATOMIC_RELAXED) * PAGESIZE;
+}
+
+static void kmem_cache_dump(struct kmem_cache_t* cache) {
+    if (!cache->slabs)
+        return;
+
+    size_t allocs = 0;
+    size_t frees = 0;
+    size_t remote_frees = 0;
+
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        allocs += cache->cpus[i].allocs;
+        frees += cache->cpus[i].frees;
+        remote_frees += cache->cpus[i].remote_frees;
+    }
+
+    WARN("\t%-14s %5lu/%-5lu bytes: %lu slabs (%lu pages each), %lu/%lu objects, %lu allocs, %lu frees (%lu remote), %lu/%lu full/empty magazines\n",
+            cache->name,
+            cache->size,
+            cache->stride,
+            cache->slabs,
+            cache->pages,
+            cache->inuse,
+            cache->slabs * cache->objs,
+            allocs,
+            frees,
+            remote_frees,
+            cache->depot_full_cnt,
+            cache->depot_empty_cnt);
+}
+
+void slab_dump() {
+    WARN("Slab caches (%lu page allocations, %lu pages, %lu pages idle):\n",
+            slab_large_allocs,
+            slab_large_pages,
+            slab_empty_pages);
+
+    for (size_t i = 0; i < SLAB_CLASSES; i++)
+        kmem_cache_dump(&kmalloc_caches[i]);
+
+    kmem_cache_dump(&kmem_cache_cache);
+    kmem_cache_dump(&slab_mag_cache);
+    kmem_cache_dump(&slab_large_cache);
+
+    spinlock_lock(&kmem_caches_lock);
+
+    for (struct kmem_cache_t* cache = kmem_caches; cache; cache = cache->next)
+        kmem_cache_dump(cache);
+
+    spinlock_release(&kmem_caches_lock);
+}
+
+void init_slab() {
+    size_t class = 0;
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        kmem_cache_setup(&kmalloc_caches[i], kmalloc_names[i], kmalloc_sizes[i], kmalloc_sizes[i] & -kmalloc_sizes[i], NULL);
+
+        for (; class * SLAB_MIN_SIZE <= kmalloc_sizes[i]; class++)
+            kmalloc_index[class] = i;
+    }
+
+    kmem_cache_setup(&kmem_cache_cache, "kmem_cache_t", sizeof(struct kmem_cache_t), CACHE_LINE_SIZE, NULL);
+    kmem_cache_setup(&slab_mag_cache, "slab_mag_t", sizeof(struct slab_mag_t), 0, NULL);
+    kmem_cache_setup(&slab_large_cache, "slab_t", sizeof(struct slab_t), 0, NULL);
+
+    slab_map_entries = totalmem / PAGESIZE;
+
+    size_t map_pages = (slab_map_entries * sizeof(struct slab_t *) + PAGESIZE - 1) / PAGESIZE;
+    struct slab_t** map = pmm_alloc(map_pages);
+
+    if (!map) {
+        ERR("Unable to allocate the page map, small allocations fall back to liballoc\n");
+        return;
+    }
+
+    memset(map, 0, map_pages * PAGESIZE);
+    slab_map = map;
+
+    TRACE("Initialized %u size classes (%u - %u bytes)\n",
+            SLAB_CLASSES,
+            SLAB_MIN_SIZE,
+            SLAB_MAX_SIZE);
+}
@@ -0,0 +1,117 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <locks.h>
+#include <sys/smp.h>
+
+#define SLAB_MIN_SIZE   16
+#define SLAB_MAX_SIZE   4096
+#define SLAB_CLASSES    16
+
+#define SLAB_MIN_OBJS   8
+
+#define SLAB_MAG_ROUNDS 30
+
+#define CACHE_LINE_SIZE 64
+
+/* There is no SRAT parsing yet, so all memory is node 0 */
+#define NUMA_NODES      1
+#define NUMA_NO_NODE    (-1)
+
+struct kmem_cache_t;
+
+/**
+ * Lives at the start of the first page of every slab. Page-granular
+ * allocations get one too (off-page, with no cache) so the page map can
+ * describe them just the same.
+ */
+struct slab_t {
+    struct slab_t* prev;
+    struct slab_t* next;
+    struct kmem_cache_t* cache;
+    void* base;
+
+    void* freelist;
+    uint32_t inuse;
+    uint32_t owner;
+    size_t pages;
+
+    /* Objects other CPUs freed, pushed with a CAS and taken as a whole */
+    void* remote;
+} __attribute__((aligned(64)));
+
+/* A magazine is a stack of free objects of one cache, 256 bytes in total */
+struct slab_mag_t {
+    struct slab_mag_t* next;
+    size_t rounds;
+    void* objs[SLAB_MAG_ROUNDS];
+};
+
+/* Per-CPU magazine pair, only ever touched by its own CPU with interrupts off */
+struct slab_cpu_t {
+    struct slab_mag_t* loaded;
+    struct slab_mag_t* prev;
+
+    size_t allocs;
+    size_t frees;
+    size_t remote_frees;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct kmem_cache_t {
+    const char* name;
+
+    size_t size;
+    size_t align;
+    size_t stride;
+    size_t offset;
+    size_t link;
+    void (*ctor)(void*);
+
+    size_t pages;
+    size_t objs;
+
+    struct slab_t* partial;
+    struct slab_t* full;
+    struct slab_t* empty;
+
+    size_t slabs;
+    size_t inuse;
+
+    spinlock_t lock;
+
+    struct slab_mag_t* depot_full;
+    struct slab_mag_t* depot_empty;
+    size_t depot_full_cnt;
+    size_t depot_empty_cnt;
+
+    /* Lowest the counts above dropped to since the last trim */
+    size_t depot_full_min;
+    size_t depot_empty_min;
+
+    spinlock_t depot_lock;
+
+    struct kmem_cache_t* next;
+
+    struct slab_cpu_t cpus[SMP_MAX_CPUS];
+};
+
+struct kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache_t* cache);
+void kmem_cache_free(struct kmem_cache_t* cache, void* ptr);
+
+void* slab_alloc(size_t size);
+void* slab_alloc_aligned(size_t size, size_t align);
+int slab_free(void* ptr);
+int slab_resize(void* ptr, size_t size);
+size_t slab_size(void* ptr);
+
+size_t slab_trim(size_t keep);
+size_t slab_idle();
+
+void init_slab();
+
+void slab_dump();
+
+#endif
@@ -1,7 +1,49 @@
 #include <vec.h>
 
+#define VEC_MIN_CAP 4
+
+/**
+ * The capacity isn't stored, it is whatever the allocator says the
+ * items array can hold. Growth doubles, so appends are amortised O(1)
+ * and krealloc gets to extend in place where it can.
+ */
+static int vec_grow(struct vector_t* v) {
+    size_t cap = v->items ? kmalloc_usable_size(v->items) / sizeof(void *) : 0;
+
+    if (v->n < cap)
+        return 1;
+
+    void** items = krealloc(v->items, (cap < VEC_MIN_CAP ? VEC_MIN_CAP : cap * 2) * sizeof(void *));
+
+    if (!items)
+        return 0;
+
+    v->items = items;
+    return 1;
+}
+
 int vec_rmi(struct vector_t* v, void* item) {
-    return -1;
+    if (!v)
+        return 0;
+
+    spinlock_lock(&v->lock);
+
+    for (size_t idx = 0; idx < v->n; idx++) {
+        if (v->items[idx] != item)
+            continue;
+
+        for (size_t i = idx; i < v->n - 1; i++) {
+            v->items[i] = v->items[i + 1];
+        }
+
+        v->n--;
+
+        spinlock_release(&v->lock);
+        return 1;
+    }
+
+    spinlock_release(&v->lock);
+    return 0;
 }
 
 int vec_rm(struct vector_t* v, size_t idx) {
@@ -10,19 +52,18 @@ int vec_rm(struct vector_t* v, size_t idx) {
     
     spinlock_lock(&v->lock);
 
-    if ((idx + 1) > v->n)
+    if ((idx + 1) > v->n) {
+        spinlock_release(&v->lock);
         return 0;
+    }
 
-    v->items[idx] = NULL;
-
-    for (size_t i = idx; i < v->n; i++) {
+    for (size_t i = idx; i < v->n - 1; i++) {
         v->items[i] = v->items[i + 1];
     }
 
-    krealloc(v->items, v->n - 1);
     v->n--;
 
-    spinlock_lock(&v->lock);
+    spinlock_release(&v->lock);
     return 1;
 }
 
@@ -32,11 +73,15 @@ void* vec_g(struct vector_t* v, size_t idx) {
 
     spinlock_lock(&v->lock);
 
-    if ((idx + 1) > v->n)
+    if ((idx + 1) > v->n) {
+        spinlock_release(&v->lock);
         return NULL;
+    }
+
+    void* item = v->items[idx];
 
     spinlock_release(&v->lock);
-    return v->items[idx];
+    return item;
 }
 
 int vec_i(struct vector_t* v, void* item, size_t idx) {
@@ -45,23 +90,17 @@ int vec_i(struct vector_t* v, void* item, size_t idx) {
 
     spinlock_lock(&v->lock);
 
-    if ((idx + 1) > v->n)
+    if ((idx + 1) > v->n || !vec_grow(v)) {
+        spinlock_release(&v->lock);
         return 0;
-
-    void** cpy = kmalloc(sizeof(void *) * v->n++);
-    
-    for (size_t i = 0; i < idx; i++) {
-        cpy[i] = v->items[i];
     }
 
-    cpy[idx] = item;
-
-    for (size_t i = (idx + 1); i < (v->n - idx); i++) {
-        cpy[i] = v->items[i];
+    for (size_t i = v->n; i > idx; i--) {
+        v->items[i] = v->items[i - 1];
     }
 
-    kfree(v->items);
-    v->items = cpy;
+    v->items[idx] = item;
+    v->n++;
 
     spinlock_release(&v->lock);
     return 1;
@@ -73,7 +112,11 @@ int vec_a(struct vector_t* v, void* item) {
 
     spinlock_lock(&v->lock);
 
-    v->items = krealloc(v->items, v->n + 1);
+    if (!vec_grow(v)) {
+        spinlock_release(&v->lock);
+        return 0;
+    }
+
     v->items[v->n] = item;
     v->n++;
 
@@ -6,10 +6,11 @@ volatile uint64_t* pmm_bitmap = (uint64_t*)&__kernel_end;
 uint64_t totalmem;
 uint64_t bitmapEntries;
 
-static spinlock_t pmm_lock;
+static mcs_lock_t pmm_lock;
 
 void* pmm_alloc(size_t pages) {
-    spinlock_lock(&pmm_lock);
+    struct mcs_node_t node;
+    mcs_lock(&pmm_lock, &node);
 
     uint64_t first_bit = 0;
     uint64_t concurrent_bits = 0;
@@ -35,7 +36,7 @@ void* pmm_alloc(size_t pages) {
         }
     }
 
-    spinlock_release(&pmm_lock);
+    mcs_release(&pmm_lock, &node);
 
     return NULL;
 
@@ -45,40 +46,103 @@ alloc:
         set_abs_bit(pmm_bitmap, i);
     }
 
-    spinlock_release(&pmm_lock);
+    mcs_release(&pmm_lock, &node);
     return (void*)(first_bit * PAGESIZE);
 }
 
+void* pmm_alloc_aligned(size_t pages, size_t align) {
+    if (align <= 1)
+        return pmm_alloc(pages);
+
+    struct mcs_node_t node;
+    mcs_lock(&pmm_lock, &node);
+
+    uint64_t total_bits_in_bitmap = totalmem / PAGESIZE;
+
+    for (uint64_t first_bit = align; first_bit + pages <= total_bits_in_bitmap; first_bit += align) {
+        uint64_t i;
+
+        for (i = 0; i < pages; i++) {
+            if (get_abs_bit(pmm_bitmap, first_bit + i))
+                break;
+        }
+
+        if (i != pages)
+            continue;
+
+        for (i = first_bit; i < first_bit + pages; i++) {
+            set_abs_bit(pmm_bitmap, i);
+        }
+
+        mcs_release(&pmm_lock, &node);
+        return (void*)(first_bit * PAGESIZE);
+    }
+
+    mcs_release(&pmm_lock, &node);
+    return NULL;
+}
+
 void pmm_free(void* ptr, size_t pages) {
-    spinlock_lock(&pmm_lock);
+    struct mcs_node_t node;
+    mcs_lock(&pmm_lock, &node);
+
+    uint64_t first_bit = (uint64_t)ptr / PAGESIZE;
+
+    for (uint64_t i = first_bit; i < first_bit + pages; i++) {
+        cls_abs_bit(pmm_bitmap, i);
+    }
+
+    mcs_release(&pmm_lock, &node);
+    return;
+}
+
+// Takes exactly the pages at ptr if they are all free, for growing a block in place
+int pmm_claim(void* ptr, size_t pages) {
+    struct mcs_node_t node;
+    mcs_lock(&pmm_lock, &node);
 
     uint64_t first_bit = (uint64_t)ptr / PAGESIZE;
     uint64_t total_bits_in_bitmap = totalmem / PAGESIZE;
 
-    for (uint64_t i = 0; i < total_bits_in_bitmap; i++) {
-        if (i == first_bit) {
-            for (uint64_t j = 0; j < pages; j++) {
-                cls_abs_bit(pmm_bitmap, j);
-            }
-            goto done;
+    if (!first_bit || first_bit + pages > total_bits_in_bitmap) {
+        mcs_release(&pmm_lock, &node);
+        return 0;
+    }
+
+    for (uint64_t i = first_bit; i < first_bit + pages; i++) {
+        if (get_abs_bit(pmm_bitmap, i)) {
+            mcs_release(&pmm_lock, &node);
+            return 0;
         }
     }
 
-done:
-    spinlock_release(&pmm_lock);
-    return;
+    for (uint64_t i = first_bit; i < first_bit + pages; i++) {
+        set_abs_bit(pmm_bitmap, i);
+    }
+
+    mcs_release(&pmm_lock, &node);
+    return 1;
 }
 
+// Sizes are in pages like the rest of the pmm, the tail is handed back on shrink
 void* pmm_realloc(void* ptr, size_t old, size_t new) {
-    spinlock_release(&pmm_lock);
+    if (new <= old) {
+        if (new < old)
+            pmm_free((void*)((uint64_t)ptr + new * PAGESIZE), old - new);
 
-    if (new < PAGESIZE)
         return ptr;
+    }
+
+    if (pmm_claim((void*)((uint64_t)ptr + old * PAGESIZE), new - old))
+        return ptr;
+
+    void* new_buffer = pmm_alloc(new);
+
+    if (!new_buffer)
+        return NULL;
 
-    uint64_t* new_buffer = (uint64_t*)pmm_alloc(new);
-    memcpy(new_buffer, ptr, old);
+    memcpy(new_buffer, ptr, old * PAGESIZE);
     pmm_free(ptr, old);
 
-    spinlock_release(&pmm_lock);
     return new_buffer;
 }
\ No newline at end of file
@@ -13,7 +13,9 @@ extern volatile uint64_t* pmm_bitmap;
 
 /* Physical Memory Allocation */
 void* pmm_alloc(size_t pages);
+void* pmm_alloc_aligned(size_t pages, size_t align);
 void pmm_free(void* ptr, size_t pages);
+int pmm_claim(void* ptr, size_t pages);
 void* pmm_realloc(void* ptr, size_t old, size_t new);
 
 #endif
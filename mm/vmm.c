@@ -1,6 +1,6 @@
 #include <mm/vmm.h>
 
-static spinlock_t vmm_lock;
+static mcs_lock_t vmm_lock;
 
 struct idx_t{
     size_t pml1idx;
@@ -39,7 +39,8 @@ void vtoidx(struct idx_t* ret, size_t* vaddr) {
 }
 
 void vmm_map(size_t* vaddr, size_t* paddr, size_t* pml4ptr, size_t flags) {
-    spinlock_lock(&vmm_lock);
+    struct mcs_node_t node;
+    mcs_lock(&vmm_lock, &node);
 
     asm volatile("cli");
 
@@ -88,13 +89,14 @@ void vmm_map(size_t* vaddr, size_t* paddr, size_t* pml4ptr, size_t flags) {
     invlpg(vaddr);
 
     asm volatile("sti");
-    spinlock_release(&vmm_lock);
+    mcs_release(&vmm_lock, &node);
 
     return;
 }
 
 void vmm_unmap(size_t* vaddr, size_t pages) {
-    spinlock_lock(&vmm_lock);
+    struct mcs_node_t node;
+    mcs_lock(&vmm_lock, &node);
     asm volatile("cli");
     
     struct idx_t indicies;
@@ -108,7 +110,7 @@ void vmm_unmap(size_t* vaddr, size_t pages) {
     }
     
     tlbflush();
-    spinlock_release(&vmm_lock);
+    mcs_release(&vmm_lock, &node);
 
     return;
 }
@@ -0,0 +1,55 @@
+#include <proc/mutex.h>
+#include <sys/smp.h>
+
+static uintptr_t mutex_self() {
+    struct thread_t* self = task_self();
+
+    return self ? (uintptr_t)self : (smp_cpu_id() << 1) | 1;
+}
+
+static int mutex_owner_running(uintptr_t owner) {
+    return (owner & 1) || task_running((struct thread_t *)owner);
+}
+
+static int mutex_acquire(struct mutex_t* mutex, uintptr_t self) {
+    uintptr_t free = 0;
+
+    return __atomic_compare_exchange_n(&mutex->owner, &free, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+int mutex_trylock(struct mutex_t* mutex) {
+    return mutex_acquire(mutex, mutex_self());
+}
+
+void mutex_lock(struct mutex_t* mutex) {
+    uintptr_t self = mutex_self();
+
+    if (mutex_acquire(mutex, self))
+        return;
+
+    for (size_t i = 0; i < MUTEX_SPINS; i++) {
+        uintptr_t owner = READ_ONCE(mutex->owner);
+
+        if (!owner) {
+            if (mutex_acquire(mutex, self))
+                return;
+
+            continue;
+        }
+
+        // Asleep holding it, no point waiting up here
+        if (!mutex_owner_running(owner))
+            break;
+
+        cpu_relax();
+    }
+
+    wait_event(&mutex->wq, mutex_acquire(mutex, self));
+}
+
+void mutex_unlock(struct mutex_t* mutex) {
+    __atomic_exchange_n(&mutex->owner, 0, __ATOMIC_SEQ_CST);
+
+    if (wait_queue_active(&mutex->wq))
+        wake_up(&mutex->wq);
+}
@@ -0,0 +1,44 @@
+#ifndef __PROC__MUTEX_H__
+#define __PROC__MUTEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <proc/wait.h>
+
+/* Most times a contender polls a running owner before it goes to sleep anyway */
+#define MUTEX_SPINS     4096
+
+/**
+ * THEORY
+ * ------
+ * For locks that may be held across I/O. A mutex is an owner word and
+ * a wait queue. Taking it is a CAS of the owner from 0 when it is free.
+ * When it isn't, and the owner is running on some CPU right now, it will
+ * most likely let go soon, so the contender polls for a while (the
+ * adaptive part). Once the owner is asleep itself, or has held on for
+ * MUTEX_SPINS polls, the contender sleeps on the queue.
+ *
+ * The owner is the holding thread, or for boot code that has no thread
+ * the CPU number tagged with bit 0, which counts as always running.
+ *
+ * Unlocking clears the owner and only takes the queue's lock if someone
+ * is queued. The full barrier in wait_prepare orders the waiter's queueing
+ * against its retry, the xchg here orders the clear against the check.
+ *
+ * Mutexes can't be taken from interrupts, and aren't recursive.
+ */
+
+struct mutex_t {
+    volatile uintptr_t owner;
+    struct wait_queue_t wq;
+};
+
+void mutex_lock(struct mutex_t* mutex);
+int mutex_trylock(struct mutex_t* mutex);
+void mutex_unlock(struct mutex_t* mutex);
+
+static inline int mutex_locked(struct mutex_t* mutex) {
+    return READ_ONCE(mutex->owner) != 0;
+}
+
+#endif
@@ -2,83 +2,1313 @@
 #include <stddef.h>
 #include <proc/task.h>
 #include <alloc.h>
+#include <slab.h>
 #include <assert.h>
-#include <bitmap.h>
 #include <io.h>
 #include <vec.h>
 #include <locks.h>
+#include <atomic.h>
+#include <rcu.h>
+#include <sys/smp.h>
+#include <sys/msrs.h>
 #include <proc/regs.h>
 #include <sys/interrupts.h>
 #include <mm/vmm.h>
 #include <drivers/apic.h>
+#include <drivers/hpet.h>
 #include <lib/rbtree.h>
+#include <drivers/serial.h>
+#include <sys/fpu.h>
+#include <sys/cpuid.h>
 
-#define T_STACK_SIZE        1024
+#undef __MODULE__
+#define __MODULE__ "sched"
+
+#define T_STACK_SIZE        0x4000
 
 #define T_STATE_NOT_READY   0
 #define T_STATE_READY       1
 #define T_STATE_RUNNING     2
+#define T_STATE_DEAD        3
+
+#define TIMER_VECTOR        32
+/* #NM, the first FPU or SIMD instruction of a thread while CR0.TS is set */
+#define FPU_TRAP_VECTOR     7
+
+/* Weight of a nice 0 thread, vruntime runs at wall clock speed for it */
+#define NICE_0_WEIGHT       1024
+
+/* Every runnable thread gets a turn within this, until there are too many for min_gran each */
+#define SCHED_LATENCY_US        6000
+#define SCHED_MIN_GRAN_US       750
+#define SCHED_WAKEUP_GRAN_US    1000
+
+/* Ticks between a CPU's load balancing runs, and the most threads one run pulls over */
+#define SCHED_BALANCE_TICKS     16
+#define SCHED_BALANCE_MAX       4
+
+/* Longest an idle CPU sleeps with its tick stopped, there are no timers to wake it sooner */
+#define SCHED_NOHZ_MAX_MS       1000
+
+#define NOHZ_TICKING    0
+#define NOHZ_IDLE       1
+#define NOHZ_KICKED     2
+
+#define CPUID_1_ECX_MONITOR (1u << 3)
 
 /**
  * THEORY
  * ------
- * Every process is a node in an rb tree.
- * Statndard CFS stuff applies.
- * 
- * The scheduler picks a process that needs to be run
- * and then the process picks the next thread that needs to
- * be run.
+ * Threads are what gets scheduled, a process only owns them. Standard
+ * CFS: every runnable thread sits in an rb tree keyed by its vruntime,
+ * the CPU time it has had scaled by NICE_0_WEIGHT / its weight, and the
+ * leftmost one, the thread furthest behind, runs next. The leftmost node
+ * is cached, so picking is O(1) and only queueing pays the O(log n).
+ *
+ * Each nice level is worth about 10% CPU against its neighbours, the
+ * weights below are 1.25x apart. Over a period of sched_latency (or
+ * min_gran per thread, if there are many) each thread gets a slice in
+ * proportion to its weight of the queue's total. The LAPIC timer tick
+ * charges the running thread and switches once its slice is used up.
+ *
+ * min_vruntime only moves forward and is where new and woken threads
+ * are placed: a new one a slice behind it, so forking can't buy CPU, and
+ * a sleeper half a latency ahead of it at most, so it gets to run soon
+ * after waking but can't bank the time it slept. A wakeup whose thread
+ * is wakeup_gran ahead of the running one preempts it with an IPI.
+ *
+ * There are two ways to switch. Preemption happens in interrupt context:
+ * the running thread's registers are what the interrupt pushed, they are
+ * saved in its ctx and it comes back through exec_regs and an iretq. A
+ * thread that yields or blocks calls into the scheduler itself, and only
+ * has to keep what the ABI says a call preserves: switch_to pushes the
+ * callee saved registers, keeps the stack pointer in sp and comes back
+ * with a ret. Either way can resume either kind. FPU and SIMD state is
+ * only switched for threads that have used it, see sys/fpu.h. Nothing is
+ * switched out while this CPU holds a spinlock (see preempt_disable), and
+ * every switch is an RCU quiescent state.
+ *
+ * Each CPU's boot context is its idle thread: it runs when nothing else
+ * can, never sits in the tree and task_self() is NULL in it.
+ *
+ * Every CPU has a runqueue of its own, with its own lock, tree and
+ * min_vruntime, and only ever schedules from it, so CPUs don't meet on a
+ * switch. Threads move between queues three ways:
+ *
+ *  - A CPU about to idle steals one from whichever queue has the most
+ *    waiting that may move (idle_balance, from task_idle)
+ *  - Every SCHED_BALANCE_TICKS ticks a CPU compares load averages and
+ *    pulls up to half the difference from the busiest (periodic_balance)
+ *  - A wakeup goes back where the thread last ran, where its cache is
+ *    warm, unless that CPU is busy and the waker's has less on it
+ *
+ * vruntimes only mean something against their own queue's min_vruntime,
+ * so a thread that moves or sleeps carries its lead over the old one and
+ * has the new one's added back. Pinned threads never move. Two queues
+ * are always locked in CPU order.
+ *
+ * A thread can be picked on one CPU while another is still on its stack,
+ * in the schedule() that switched it out. on_cpu stays set until
+ * exec_regs has moved off that stack, and whoever picked it waits for
+ * that before loading its registers.
+ *
+ * The tick only runs while a CPU has threads to run. Going idle, a CPU
+ * stops it and arms a single SCHED_NOHZ_MAX_MS timeout instead (nohz),
+ * unless RCU callbacks wait there. A wakeup's IPI brings it back, and a
+ * busy CPU with unpinned threads waiting kicks one such CPU to come and
+ * steal them, since it won't be ticking to notice. Switching to a thread
+ * starts the tick again and decays load_avg for the ticks it missed.
+ *
+ * Where the CPU has MONITOR/MWAIT, an idle CPU waits on its queue's
+ * need_resched rather than halting (task_halt), and says so in polling.
+ * Waking it is then just the store to need_resched, only a CPU that
+ * isn't polling needs the IPI (resched_cpu).
  */
 
 struct thread_t {
+    struct rb_node_t base;
+
     tid_t tid;
     pid_t ppid;
     size_t tpl;
 
     size_t cpu;
     size_t state;
+    int on_rq;
+
+    // Some CPU is still on its stack, see exec_regs
+    volatile int on_cpu;
+    int pinned;
+
+    int nice;
+    uint64_t weight;
+    uint64_t vruntime;
+
+    // TSC when it was last charged, its total, and that total when it was picked
+    uint64_t exec_start;
+    uint64_t sum_exec;
+    uint64_t slice_start;
+
+    void* stack;
+    struct thread_t* next_dead;
+
+    // Its process's, NULL to run on whatever is loaded
+    size_t* pml4;
+
+    // Saved and restored on every switch once used, fpu_cpu is where the registers were last loaded
+    void* fpu;
+    int fpu_used;
+    size_t fpu_cpu;
 
     struct vector_t* fds;
+
+    // Saved by switch_to when nonzero, else the registers are in ctx
+    size_t sp;
     struct regs_t ctx;
 };
 
 struct process_t {
-    struct rb_node_t base;
-
     pid_t pid;
     pid_t ppid;
 
     char* cwd;
-    
+
     size_t* pml4;
     size_t* stack;
 
     struct vector_t* children;
     struct vector_t* threads;
     size_t l_tid_idx;
+};
+
+struct runqueue_t {
+    spinlock_t lock;
+    size_t cpu;
 
-    size_t vruntime;
-    size_t static_prio, rt_prio, prio;
+    struct rb_root_t tree;
+    struct rb_node_t* leftmost;
+    size_t queued;
+
+    // The queued threads that aren't pinned, all there is to steal
+    size_t migratable;
+
+    // Weight of every runnable thread, the queued ones and the running one
+    uint64_t load;
+    uint64_t min_vruntime;
+
+    // load decayed by 1/8 a tick, what balancing goes by so a burst doesn't move threads
+    uint64_t load_avg;
+    size_t ticks;
+
+    // NOHZ_IDLE while halted with the tick stopped, NOHZ_KICKED once a busy CPU has asked it to help
+    volatile int nohz;
+
+    // TSC when the tick stopped, load_avg is decayed for the ticks missed once it starts again
+    uint64_t nohz_since;
+
+    // What an idle CPU MONITORs, on a line of its own so nothing else written here wakes it
+    struct {
+        volatile int need_resched;
+        volatile int polling;
+    } __attribute__((aligned(64))) wake;
+
+    struct thread_t* curr;
+    struct thread_t idle;
+
+    // Exited threads whose stacks were still in use when they switched away
+    struct thread_t* dead;
+
+    // Whose state the FPU registers hold, it may have been saved since
+    struct thread_t* fpu_owner;
+
+    size_t switches;
+    // Threads taken from other CPUs when about to idle, and by periodic balancing
+    size_t steals;
+    size_t pulls;
+} __attribute__((aligned(64)));
+
+/**
+ * A thread switched out by an interrupt is resumed from its ctx with
+ * exec_regs, one that gave up the CPU itself from the sp switch_to left
+ * it. Each clears *done, if not NULL, once it is off the stack it was
+ * called on.
+ */
+extern void exec_regs(struct regs_t* regs, volatile int* done);
+extern void resume_sp(size_t sp, volatile int* done);
+extern void switch_to(size_t* prev_sp, size_t next_sp, volatile int* done);
+extern void switch_to_regs(size_t* prev_sp, struct regs_t* next, volatile int* done);
+
+/* Weight by nice level from -20 to 19, each 1.25x the next */
+static const uint32_t nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
 };
 
-extern void exec_regs(struct regs_t* regs);
+static struct runqueue_t runqueues[SMP_MAX_CPUS];
+
+static struct vector_t processes;
+static spinlock_t processes_lock;
+
+// pid 0 is the kernel, the first process made, tid 0 is a failed task_tcreate
+static atomic64_t last_pid = ATOMIC_INIT(-1);
+static atomic64_t last_tid;
+
+static struct kmem_cache_t* process_cache;
+static struct kmem_cache_t* thread_cache;
+
+// In TSC cycles, set up by init_scheduler
+static uint64_t sched_tsc_per_ms;
+static uint64_t sched_latency;
+static uint64_t sched_min_gran;
+static uint64_t sched_wakeup_gran;
+
+// Idle CPUs MWAIT on their need_resched instead of halting
+static int sched_mwait;
+
+static struct regs_t default_krnl = { .cs = 0x08, .rflags = 0x202, .ss = 0x10 };
+static struct regs_t default_usr = { .cs = 0x18, .rflags = 0x202, .ss = 0x20 };
+
+static int vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+static int thread_cmp(struct rb_node_t* a, struct rb_node_t* b, void* arg) {
+    (void)arg;
+
+    struct thread_t* x = (struct thread_t *)a;
+    struct thread_t* y = (struct thread_t *)b;
+
+    if (x->vruntime != y->vruntime)
+        return vruntime_before(x->vruntime, y->vruntime) ? -1 : 1;
+
+    // Never 0, rb_insert would take it for the same node
+    return x->tid < y->tid ? -1 : 1;
+}
+
+// delta of CPU time in the vruntime of a thread of weight
+static uint64_t calc_delta(uint64_t delta, uint64_t weight) {
+    if (weight == NICE_0_WEIGHT)
+        return delta;
+
+    return delta * NICE_0_WEIGHT / weight;
+}
+
+static void enqueue(struct runqueue_t* rq, struct thread_t* thread) {
+    rb_insert(&rq->tree, thread_cmp, NULL, &thread->base);
+
+    if (!rq->leftmost || thread_cmp(&thread->base, rq->leftmost, NULL) < 0)
+        rq->leftmost = &thread->base;
+
+    rq->queued++;
+    rq->migratable += !thread->pinned;
+}
+
+static void dequeue(struct runqueue_t* rq, struct thread_t* thread) {
+    if (rq->leftmost == &thread->base)
+        rq->leftmost = rb_next(&thread->base);
+
+    rb_erase(&rq->tree, &thread->base);
+    rq->queued--;
+    rq->migratable -= !thread->pinned;
+}
+
+static void update_min_vruntime(struct runqueue_t* rq) {
+    struct thread_t* curr = rq->curr != &rq->idle ? rq->curr : NULL;
+    struct thread_t* first = (struct thread_t *)rq->leftmost;
+    uint64_t vruntime;
+
+    if (curr && first)
+        vruntime = vruntime_before(curr->vruntime, first->vruntime) ? curr->vruntime : first->vruntime;
+    else if (curr || first)
+        vruntime = curr ? curr->vruntime : first->vruntime;
+    else
+        return;
+
+    if (vruntime_before(rq->min_vruntime, vruntime))
+        rq->min_vruntime = vruntime;
+}
+
+// Charges the running thread for the time since it was last charged
+static void update_curr(struct runqueue_t* rq, uint64_t now) {
+    struct thread_t* curr = rq->curr;
+
+    if (curr == &rq->idle)
+        return;
+
+    uint64_t delta = now - curr->exec_start;
+
+    curr->exec_start = now;
+    curr->sum_exec += delta;
+    curr->vruntime += calc_delta(delta, curr->weight);
+
+    update_min_vruntime(rq);
+}
+
+static uint64_t sched_period(struct runqueue_t* rq) {
+    size_t running = rq->queued + (rq->curr != &rq->idle);
+
+    if (running > sched_latency / sched_min_gran)
+        return running * sched_min_gran;
+
+    return sched_latency;
+}
+
+// The thread's share of a period, its weight must already be in rq->load
+static uint64_t sched_slice(struct runqueue_t* rq, struct thread_t* thread) {
+    return sched_period(rq) * thread->weight / rq->load;
+}
+
+static void place_thread(struct runqueue_t* rq, struct thread_t* thread, int initial) {
+    uint64_t vruntime = rq->min_vruntime;
+
+    if (initial) {
+        thread->vruntime = vruntime + calc_delta(sched_slice(rq, thread), thread->weight);
+        return;
+    }
+
+    vruntime -= sched_latency / 2;
+
+    if (vruntime_before(thread->vruntime, vruntime))
+        thread->vruntime = vruntime;
+}
+
+static int tick_preempt(struct runqueue_t* rq) {
+    struct thread_t* curr = rq->curr;
+    struct thread_t* first = (struct thread_t *)rq->leftmost;
+
+    if (!first)
+        return 0;
+
+    if (curr == &rq->idle)
+        return 1;
+
+    uint64_t ran = curr->sum_exec - curr->slice_start;
+    uint64_t slice = sched_slice(rq, curr);
+
+    if (ran >= slice)
+        return 1;
+
+    if (ran < sched_min_gran)
+        return 0;
+
+    // Far enough ahead of the next one that it had better run now
+    return (int64_t)(curr->vruntime - first->vruntime) > (int64_t)slice;
+}
+
+static int wakeup_preempt(struct runqueue_t* rq, struct thread_t* thread) {
+    struct thread_t* curr = rq->curr;
+
+    if (curr == &rq->idle)
+        return 1;
+
+    return (int64_t)(curr->vruntime - thread->vruntime) > (int64_t)calc_delta(sched_wakeup_gran, thread->weight);
+}
+
+// Makes a thread that isn't on the queue runnable, rq->lock held. Returns whether it should preempt
+static int activate(struct runqueue_t* rq, struct thread_t* thread, int initial) {
+    update_curr(rq, rdtsc());
+
+    thread->on_rq = 1;
+    rq->load += thread->weight;
+
+    place_thread(rq, thread, initial);
+    enqueue(rq, thread);
+
+    return wakeup_preempt(rq, thread);
+}
+
+static struct runqueue_t* this_rq() {
+    return &runqueues[smp_cpu_id()];
+}
+
+static int rq_idle(struct runqueue_t* rq) {
+    return READ_ONCE(rq->curr) == &rq->idle;
+}
+
+// Lowest CPU first, so two CPUs locking the same pair can't deadlock
+static void double_lock(struct runqueue_t* a, struct runqueue_t* b) {
+    if (a == b) {
+        spinlock_lock(&a->lock);
+        return;
+    }
+
+    if (a->cpu > b->cpu) {
+        struct runqueue_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    spinlock_lock(&a->lock);
+    spinlock_lock(&b->lock);
+}
+
+static void double_release(struct runqueue_t* a, struct runqueue_t* b) {
+    spinlock_release(&a->lock);
+
+    if (a != b)
+        spinlock_release(&b->lock);
+}
+
+// Locks the queue the thread belongs to, it can't be moved off it while that is held
+static struct runqueue_t* task_rq_lock(struct thread_t* thread) {
+    for (;;) {
+        struct runqueue_t* rq = &runqueues[READ_ONCE(thread->cpu)];
+
+        spinlock_lock(&rq->lock);
+
+        if (thread->cpu == rq->cpu)
+            return rq;
+
+        spinlock_release(&rq->lock);
+    }
+}
+
+// Moves a queued thread from src to dst, both locks held
+static void migrate(struct runqueue_t* src, struct runqueue_t* dst, struct thread_t* thread) {
+    dequeue(src, thread);
+
+    src->load -= thread->weight;
+    src->load_avg -= src->load_avg < thread->weight ? src->load_avg : thread->weight;
+
+    thread->vruntime = thread->vruntime - src->min_vruntime + dst->min_vruntime;
+    thread->cpu = dst->cpu;
+
+    // The averages move with it, or the next balance would pull it all over again
+    dst->load += thread->weight;
+    dst->load_avg += thread->weight;
+
+    enqueue(dst, thread);
+}
+
+/**
+ * Moves up to max threads from src to dst, as long as their weights
+ * add up to no more than budget. Both locks held, returns how many
+ * threads were moved.
+ */
+static size_t pull(struct runqueue_t* src, struct runqueue_t* dst, size_t max, uint64_t budget) {
+    struct rb_node_t* node = src->leftmost;
+    size_t moved = 0;
+
+    while (node && moved < max) {
+        struct thread_t* thread = (struct thread_t *)node;
+        node = rb_next(node);
+
+        if (thread->pinned || thread->weight > budget)
+            continue;
+
+        migrate(src, dst, thread);
+
+        budget -= thread->weight;
+        moved++;
+    }
+
+    return moved;
+}
+
+// Nothing to run here, take a thread from whichever queue has the most waiting that may move
+static size_t idle_balance(struct runqueue_t* rq) {
+    struct runqueue_t* busiest = NULL;
+    size_t most = 0;
+
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        size_t migratable = READ_ONCE(runqueues[i].migratable);
+
+        if (&runqueues[i] != rq && migratable > most) {
+            busiest = &runqueues[i];
+            most = migratable;
+        }
+    }
+
+    if (!busiest)
+        return 0;
+
+    double_lock(rq, busiest);
+
+    size_t moved = pull(busiest, rq, 1, UINT64_MAX);
+    rq->steals += moved;
+
+    double_release(rq, busiest);
+
+    return moved;
+}
+
+// Evens this queue's load average out with the busiest one's, from the tick
+static void periodic_balance(struct runqueue_t* rq) {
+    struct runqueue_t* busiest = NULL;
+    uint64_t ours = READ_ONCE(rq->load_avg);
+    uint64_t most = ours;
+
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        uint64_t load = READ_ONCE(runqueues[i].load_avg);
+
+        if (load > most && READ_ONCE(runqueues[i].migratable)) {
+            busiest = &runqueues[i];
+            most = load;
+        }
+    }
+
+    if (!busiest)
+        return;
+
+    double_lock(rq, busiest);
+
+    // Half the difference, anything more and it would just come back
+    rq->pulls += pull(busiest, rq, SCHED_BALANCE_MAX, (most - ours) / 2);
+
+    double_release(rq, busiest);
+}
+
+/**
+ * Where a woken thread should go: back where it last ran while its
+ * cache there is likely warm, unless that CPU is busier than the one
+ * waking it, which has just touched whatever the wakeup was about.
+ */
+static struct runqueue_t* select_rq(struct thread_t* thread, size_t waker) {
+    struct runqueue_t* prev = &runqueues[thread->cpu];
+    struct runqueue_t* local = &runqueues[waker];
+
+    if (thread->pinned || prev == local || rq_idle(prev))
+        return prev;
+
+    return READ_ONCE(local->load) < READ_ONCE(prev->load) ? local : prev;
+}
+
+// Where a new thread goes, it has no cache anywhere yet
+static struct runqueue_t* idlest_rq() {
+    struct runqueue_t* idlest = &runqueues[0];
+
+    for (size_t i = 1; i < smp_cpu_count; i++) {
+        if (READ_ONCE(runqueues[i].load) < READ_ONCE(idlest->load))
+            idlest = &runqueues[i];
+    }
+
+    return idlest;
+}
+
+static struct process_t* task_find(pid_t pid) {
+    struct process_t* found = NULL;
+
+    spinlock_lock(&processes_lock);
+
+    for (size_t i = 0; i < processes.n; i++) {
+        struct process_t* proc = processes.items[i];
+
+        if (proc->pid == pid) {
+            found = proc;
+            break;
+        }
+    }
+
+    spinlock_release(&processes_lock);
+    return found;
+}
+
+static struct thread_t* task_tfind(pid_t pid, tid_t tid) {
+    struct process_t* proc = task_find(pid);
+
+    if (!proc)
+        return NULL;
+
+    for (size_t i = 0;; i++) {
+        struct thread_t* thread = vec_g(proc->threads, i);
+
+        if (!thread || thread->tid == tid)
+            return thread;
+    }
+}
+
+static void task_reap(struct thread_t* dead) {
+    while (dead) {
+        struct thread_t* next = dead->next_dead;
+        struct process_t* proc = task_find(dead->ppid);
+
+        if (proc)
+            vec_rmi(proc->threads, dead);
+
+        kfree(dead->stack);
+        fpu_free(dead->fpu);
+        kmem_cache_free(thread_cache, dead);
+
+        dead = next;
+    }
+}
+
+// NULL in boot and idle code
+struct thread_t* task_self() {
+    return this_cpu_read(thread);
+}
+
+int task_running(struct thread_t* thread) {
+    return READ_ONCE(thread->state) == T_STATE_RUNNING;
+}
+
+/**
+ * Gets rq's CPU to schedule soon. The store wakes one that is MWAITing
+ * on it, anything else takes an IPI. Both are SEQ_CST against the same
+ * pair in task_halt, so either we see it polling or it sees the store.
+ */
+static void resched_cpu(struct runqueue_t* rq) {
+    __atomic_store_n(&rq->wake.need_resched, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&rq->wake.polling, __ATOMIC_SEQ_CST))
+        send_ipi(rq->cpu, TASK_WAKE_VECTOR);
+}
+
+// Back to a tick a millisecond, before this CPU runs a thread again
+static void nohz_exit(struct runqueue_t* rq) {
+    if (!READ_ONCE(rq->nohz))
+        return;
+
+    WRITE_ONCE(rq->nohz, NOHZ_TICKING);
+    lapic_timer_start();
+
+    // Nothing ran while it was off, each tick missed would have taken an eighth
+    uint64_t missed = (rdtsc() - rq->nohz_since) / sched_tsc_per_ms;
+
+    spinlock_lock(&rq->lock);
+
+    for (; missed && rq->load_avg; missed--)
+        rq->load_avg = rq->load_avg * 7 / 8;
+
+    spinlock_release(&rq->lock);
+}
+
+/**
+ * Nothing to run, so the tick only has to come round if RCU callbacks
+ * are waiting here. Otherwise the timer fires once, SCHED_NOHZ_MAX_MS
+ * out, and a wakeup or a busy CPU's kick brings us back before that.
+ */
+static void nohz_enter(struct runqueue_t* rq) {
+    if (rcu_needs_cpu()) {
+        nohz_exit(rq);
+        return;
+    }
+
+    if (!READ_ONCE(rq->nohz))
+        rq->nohz_since = rdtsc();
+
+    WRITE_ONCE(rq->nohz, NOHZ_IDLE);
+    lapic_timer_oneshot(SCHED_NOHZ_MAX_MS);
+
+    rcu_idle_enter();
+}
+
+// Has threads waiting that may move, wakes one CPU without a tick to come and steal them
+static void nohz_kick(struct runqueue_t* rq) {
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        int nohz = NOHZ_IDLE;
+
+        if (&runqueues[i] != rq &&
+                __atomic_compare_exchange_n(&runqueues[i].nohz, &nohz, NOHZ_KICKED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            resched_cpu(&runqueues[i]);
+            return;
+        }
+    }
+}
+
+/**
+ * A thread that never used the FPU runs with TS set and traps if it
+ * starts to. The registers aren't reloaded for the thread they were
+ * saved from, if it hasn't been loaded anywhere else since.
+ */
+static void switch_fpu(struct runqueue_t* rq, struct thread_t* prev, struct thread_t* next) {
+    if (prev->fpu_used) {
+        fpu_save(prev->fpu);
+        rq->fpu_owner = prev;
+    }
+
+    if (!next->fpu_used) {
+        fpu_disable();
+        return;
+    }
+
+    fpu_enable();
+
+    if (rq->fpu_owner != next || next->fpu_cpu != rq->cpu)
+        fpu_restore(next->fpu);
+
+    rq->fpu_owner = next;
+    next->fpu_cpu = rq->cpu;
+}
+
+// Kernel threads and idle run on whatever is loaded, they only use the kernel half
+static void switch_mm(struct thread_t* next) {
+    if (next->pml4 && next->pml4 != get_pml4())
+        set_pml4((size_t)next->pml4);
+}
+
+/**
+ * Puts the running thread back on this CPU's queue, or to sleep, and
+ * picks the leftmost one to run next, which may be the same one. Its
+ * registers have to be saved already, or be saved by the switch before
+ * on_cpu clears. Called with interrupts off and nothing held on this CPU.
+ */
+static struct thread_t* pick_next(struct runqueue_t* rq) {
+    uint64_t now = rdtsc();
+
+    spinlock_lock(&rq->lock);
+
+    struct thread_t* prev = rq->curr;
+    update_curr(rq, now);
+
+    if (prev != &rq->idle) {
+        size_t state = __atomic_load_n(&prev->state, __ATOMIC_ACQUIRE);
+
+        // Asleep, unless task_wake got to it first. A later one finds on_rq clear and queues it itself
+        if (state == T_STATE_NOT_READY || state == T_STATE_DEAD) {
+            prev->on_rq = 0;
+            rq->load -= prev->weight;
+
+            // The wakeup may queue it elsewhere, it adds that queue's back
+            prev->vruntime -= rq->min_vruntime;
+        } else {
+            prev->state = T_STATE_READY;
+            enqueue(rq, prev);
+        }
+    }
+
+    // Whatever died before is off its stack by now, prev is still on its own and goes next time
+    struct thread_t* dead = rq->dead;
+    rq->dead = NULL;
+
+    if (prev != &rq->idle && prev->state == T_STATE_DEAD) {
+        prev->next_dead = NULL;
+        rq->dead = prev;
+    }
+
+    struct thread_t* next = &rq->idle;
+
+    if (rq->leftmost) {
+        next = (struct thread_t *)rq->leftmost;
+        dequeue(rq, next);
+
+        next->state = T_STATE_RUNNING;
+        next->slice_start = next->sum_exec;
+    }
+
+    next->exec_start = now;
+
+    rq->curr = next;
+    this_cpu_write(thread, next != &rq->idle ? next : NULL);
+
+    if (next != prev)
+        rq->switches++;
+
+    spinlock_release(&rq->lock);
+
+    task_reap(dead);
+
+    rcu_note_qs();
+
+    if (next == prev)
+        return next;
+
+    // Stolen or woken here while the CPU it last ran on is still switching away from it
+    if (next != &rq->idle) {
+        while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+            cpu_relax();
+
+        next->on_cpu = 1;
+    }
+
+    if (next != &rq->idle)
+        nohz_exit(rq);
+
+    switch_fpu(rq, prev, next);
+    switch_mm(next);
+
+    return next;
+}
+
+/**
+ * The interrupt path, for preemption. regs is what the interrupt pushed
+ * for the running thread, it carries on from there through exec_regs
+ * when it is picked again.
+ */
+void schedule(struct regs_t* regs) {
+    struct runqueue_t* rq = this_rq();
+    struct thread_t* prev = rq->curr;
+
+    prev->ctx = *regs;
+    prev->sp = 0;
+
+    struct thread_t* next = pick_next(rq);
+
+    if (next == prev)
+        return;
+
+    volatile int* done = prev != &rq->idle ? &prev->on_cpu : NULL;
+
+    // Never returns to isr_handler, which would send it
+    x2apic_write(LAPIC_REG_EOI, 0);
+
+    if (next->sp)
+        resume_sp(next->sp, done);
+    else
+        exec_regs(&next->ctx, done);
+}
+
+static void task_tick(struct regs_t* regs) {
+    // It holds a lock, so nothing can be switched in and it isn't quiescent either
+    if (this_cpu_read(preempt))
+        return;
+
+    // Nor any lock a callback could want, so a CPU that never idles still gets through its batches
+    rcu_qs();
+
+    struct runqueue_t* rq = this_rq();
+
+    // ticks starts at the CPU number, so they don't all go looking at once
+    if (!(++rq->ticks % SCHED_BALANCE_TICKS))
+        periodic_balance(rq);
+
+    spinlock_lock(&rq->lock);
+
+    update_curr(rq, rdtsc());
+    rq->load_avg = (rq->load_avg * 7 + rq->load) / 8;
+
+    int resched = tick_preempt(rq);
+    int waiting = rq->migratable && rq->curr != &rq->idle;
+
+    spinlock_release(&rq->lock);
+
+    if (waiting)
+        nohz_kick(rq);
+
+    if (resched)
+        schedule(regs);
+}
+
+// The thread's first FPU instruction, it gets state of its own and runs it again
+static void task_fpu_trap(struct regs_t* regs) {
+    struct runqueue_t* rq = this_rq();
+    struct thread_t* self = task_self();
+
+    // The kernel is built without SSE, so idle getting here is a bug
+    if (!self || (!self->fpu && !(self->fpu = fpu_alloc()))) {
+        ERR("No FPU state for %s at %#lx\n", self ? "the thread" : "idle", regs->rip);
+
+        for (;;)
+            asm volatile("cli\n\t"
+                         "hlt");
+    }
+
+    fpu_enable();
+    fpu_restore(self->fpu);
+
+    self->fpu_used = 1;
+    self->fpu_cpu = rq->cpu;
+    rq->fpu_owner = self;
+}
+
+// A woken thread should preempt, unless a lock is held, then the next tick does it
+static void task_resched(struct regs_t* regs) {
+    if (!this_cpu_read(preempt))
+        schedule(regs);
+}
+
+/**
+ * The direct path, for giving up the CPU. Only the callee saved
+ * registers go on our stack and the stack pointer in sp, we carry on
+ * from the switch_to call when we are picked again.
+ */
+void task_yield() {
+    size_t flags = irq_save();
+    struct runqueue_t* rq = this_rq();
+    struct thread_t* prev = rq->curr;
+    struct thread_t* next = pick_next(rq);
+
+    if (next != prev) {
+        volatile int* done = prev != &rq->idle ? &prev->on_cpu : NULL;
+
+        if (next->sp)
+            switch_to(&prev->sp, next->sp, done);
+        else
+            switch_to_regs(&prev->sp, &next->ctx, done);
+    }
+
+    // Maybe on another CPU by now
+    irq_restore(flags);
+}
+
+/**
+ * Called from each CPU's idle loop before it halts. Runs whatever is on
+ * this CPU's queue, or can be stolen from another one, and once nothing
+ * is left stops the tick for the halt. Returns 0 while the scheduler
+ * hasn't started on this CPU, there is no timer to wake it from a halt
+ * then.
+ */
+int task_idle() {
+    size_t flags = irq_save();
+    struct runqueue_t* rq = this_rq();
+    int started = READ_ONCE(rq->curr) != NULL;
+
+    if (started) {
+        // Cleared before looking, a wakeup after this sets it again and task_halt sees it
+        __atomic_exchange_n(&rq->wake.need_resched, 0, __ATOMIC_SEQ_CST);
+
+        // We only get the CPU back once everything it picked up sleeps
+        if (READ_ONCE(rq->queued) || idle_balance(rq))
+            task_yield();
+
+        nohz_enter(rq);
+    }
+
+    irq_restore(flags);
+
+    return started;
+}
+
+/**
+ * Waits after task_idle until this CPU may have something to do: an
+ * interrupt, or with MWAIT a store to need_resched as well. Interrupts
+ * are taken while waiting, but are off again when it returns.
+ */
+void task_halt() {
+    size_t flags = irq_save();
+    struct runqueue_t* rq = this_rq();
+
+    if (!sched_mwait) {
+        asm volatile("sti\n\t"
+                     "hlt\n\t"
+                     "cli" ::: "memory");
+
+        irq_restore(flags);
+        return;
+    }
 
-static spinlock_t scheduler_lock;
+    __atomic_store_n(&rq->wake.polling, 1, __ATOMIC_SEQ_CST);
 
-struct rb_root_t* root;
+    // Armed before the check, a store in between still ends the MWAIT
+    asm volatile("monitor" :: "a"(&rq->wake.need_resched), "c"(0), "d"(0));
 
-static struct bitmap_t* pid_bitmap;
-static struct bitmap_t* tid_bitmap;
+    if (!__atomic_load_n(&rq->wake.need_resched, __ATOMIC_SEQ_CST))
+        asm volatile("sti\n\t"
+                     "mwait\n\t"
+                     "cli" :: "a"(0), "c"(0) : "memory");
 
-static struct regs_t default_krnl = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x08,0x202,0,0x10};
-static struct regs_t default_usr = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x18,0x202,0,0x20};
+    WRITE_ONCE(rq->wake.polling, 0);
+
+    // Woken by the store, there was no interrupt to take us out of RCU's idle
+    rcu_idle_exit();
+
+    irq_restore(flags);
+}
+
+/* Milliseconds since the scheduler started counting, off the TSC */
+uint64_t task_clock_ms() {
+    return sched_tsc_per_ms ? rdtsc() / sched_tsc_per_ms : 0;
+}
+
+/**
+ * Blocks the calling thread until task_wake. The state changes before
+ * lock is dropped, so a waker that needs the lock to find us can't
+ * slip in between and be lost: it either finds us still on the queue
+ * and schedule() puts us back, or finds us off it and queues us.
+ */
+void task_block(spinlock_t* lock) {
+    struct thread_t* self = task_self();
+
+    WRITE_ONCE(self->state, T_STATE_NOT_READY);
+    spinlock_release(lock);
+
+    if (this_cpu_read(preempt))
+        WARN("Thread %lu blocks holding a lock\n", self->tid);
+
+    task_yield();
+}
+
+void task_wake(struct thread_t* thread) {
+    size_t state = T_STATE_NOT_READY;
+
+    if (!__atomic_compare_exchange_n(&thread->state, &state, T_STATE_READY, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+
+    size_t flags = irq_save();
+    struct runqueue_t* src;
+    struct runqueue_t* dst;
+
+    // The queue it is on has to be held to see on_rq, the one it goes to to queue it
+    for (;;) {
+        size_t cpu = READ_ONCE(thread->cpu);
+
+        src = &runqueues[cpu];
+        dst = select_rq(thread, smp_cpu_id());
+
+        double_lock(src, dst);
+
+        if (thread->cpu == cpu)
+            break;
+
+        double_release(src, dst);
+    }
+
+    int preempt = 0;
+
+    if (!thread->on_rq) {
+        thread->cpu = dst->cpu;
+        thread->vruntime += dst->min_vruntime;
+
+        preempt = activate(dst, thread, 0);
+    }
+
+    double_release(src, dst);
+    irq_restore(flags);
+
+    // To ourselves too, it lands once we are out of whatever did the waking
+    if (preempt)
+        resched_cpu(dst);
+}
+
+__attribute__((noreturn))
+void task_exit() {
+    struct thread_t* self = task_self();
+
+    asm volatile("cli");
+    WRITE_ONCE(self->state, T_STATE_DEAD);
+    task_yield();
+
+    for (;;)
+        ;
+}
+
+pid_t task_pcreate() {
+    struct process_t* proc = kmem_cache_alloc(process_cache);
+
+    if (!proc)
+        return 0;
+
+    proc->pid = atomic64_add_return(&last_pid, 1, ATOMIC_RELAXED);
+    proc->ppid = 0;
+    proc->cwd = "/";
+    proc->pml4 = (size_t *)get_pml4();
+    proc->stack = NULL;
+    proc->l_tid_idx = 0;
+
+    proc->children = kmalloc(sizeof(struct vector_t));
+    proc->threads = kmalloc(sizeof(struct vector_t));
+
+    if (!proc->children || !proc->threads) {
+        if (proc->children)
+            kfree(proc->children);
+        if (proc->threads)
+            kfree(proc->threads);
+        kmem_cache_free(process_cache, proc);
+        return 0;
+    }
+
+    vec_n(proc->children);
+    vec_n(proc->threads);
+
+    spinlock_lock(&processes_lock);
+    vec_a(&processes, proc);
+    spinlock_release(&processes_lock);
+
+    return proc->pid;
+}
+
+/**
+ * Starts entry(arg) in a new kernel thread of ppid, returning from entry
+ * exits it. With TASK_CPU_ANY it starts on the least loaded CPU and
+ * balancing may move it, otherwise it stays on cpu for good.
+ */
+tid_t task_tcreate_on(pid_t ppid, void (*entry)(void*), void* arg, size_t cpu) {
+    struct process_t* proc = task_find(ppid);
+
+    if (!proc || (cpu != TASK_CPU_ANY && cpu >= smp_cpu_count))
+        return 0;
+
+    struct thread_t* thread = kmem_cache_alloc(thread_cache);
+    void* stack = kmalloc(T_STACK_SIZE);
+
+    if (!thread || !stack) {
+        kfree(stack);
+
+        if (thread)
+            kmem_cache_free(thread_cache, thread);
+
+        return 0;
+    }
+
+    thread->tid = atomic64_add_return(&last_tid, 1, ATOMIC_RELAXED);
+    thread->ppid = ppid;
+    thread->tpl = 0;
+    thread->state = T_STATE_READY;
+    thread->on_rq = 0;
+    thread->on_cpu = 0;
+    thread->pinned = cpu != TASK_CPU_ANY;
+
+    thread->nice = 0;
+    thread->weight = nice_to_weight[-TASK_NICE_MIN];
+    thread->vruntime = 0;
+    thread->sum_exec = 0;
+    thread->slice_start = 0;
+
+    thread->stack = stack;
+    thread->next_dead = NULL;
+    thread->pml4 = proc->pml4;
+    thread->sp = 0;
+
+    thread->fpu = NULL;
+    thread->fpu_used = 0;
+    thread->fpu_cpu = TASK_CPU_ANY;
+
+    // Nothing opens per-thread descriptors yet, the vector comes with the first one
+    thread->fds = NULL;
+
+    // As if entry had been called from task_exit, with the stack aligned the way the ABI wants it
+    size_t* sp = (size_t *)(((size_t)stack + T_STACK_SIZE) & ~0xFul) - 1;
+    *sp = (size_t)task_exit;
+
+    thread->ctx = default_krnl;
+    thread->ctx.rip = (uint64_t)entry;
+    thread->ctx.rdi = (uint64_t)arg;
+    thread->ctx.rsp = (uint64_t)sp;
+
+    if (!vec_a(proc->threads, thread)) {
+        kfree(stack);
+        kmem_cache_free(thread_cache, thread);
+        return 0;
+    }
+
+    size_t flags = irq_save();
+    struct runqueue_t* rq = cpu != TASK_CPU_ANY ? &runqueues[cpu] : idlest_rq();
+
+    spinlock_lock(&rq->lock);
+
+    thread->cpu = rq->cpu;
+    int preempt = activate(rq, thread, 1);
+
+    spinlock_release(&rq->lock);
+    irq_restore(flags);
+
+    if (preempt)
+        resched_cpu(rq);
+
+    return thread->tid;
+}
+
+tid_t task_tcreate(pid_t ppid, void (*entry)(void*), void* arg) {
+    return task_tcreate_on(ppid, entry, arg, TASK_CPU_ANY);
+}
+
+int task_tnice(pid_t pid, tid_t tid, int nice) {
+    struct thread_t* thread = task_tfind(pid, tid);
+
+    if (!thread || nice < TASK_NICE_MIN || nice > TASK_NICE_MAX)
+        return 0;
+
+    size_t flags = irq_save();
+    struct runqueue_t* rq = task_rq_lock(thread);
+
+    // Queued by vruntime only, so it can stay where it is
+    if (thread->on_rq)
+        rq->load += nice_to_weight[nice - TASK_NICE_MIN] - thread->weight;
+
+    thread->nice = nice;
+    thread->weight = nice_to_weight[nice - TASK_NICE_MIN];
+
+    spinlock_release(&rq->lock);
+    irq_restore(flags);
+
+    return 1;
+}
+
+/* How much CPU a thread at nice gets against the others, NICE_0_WEIGHT at 0 */
+size_t task_weight(int nice) {
+    if (nice < TASK_NICE_MIN || nice > TASK_NICE_MAX)
+        return 0;
+
+    return nice_to_weight[nice - TASK_NICE_MIN];
+}
+
+static void scheduler_calibrate() {
+    uint64_t start = rdtsc();
+    hpet_poll_and_sleep(10);
+    sched_tsc_per_ms = (rdtsc() - start) / 10;
+
+    sched_latency = SCHED_LATENCY_US * sched_tsc_per_ms / 1000;
+    sched_min_gran = SCHED_MIN_GRAN_US * sched_tsc_per_ms / 1000;
+    sched_wakeup_gran = SCHED_WAKEUP_GRAN_US * sched_tsc_per_ms / 1000;
+}
+
+static void sched_cmd(char* args) {
+    (void)args;
+
+    TRACE("\t%-4s %-6s %6s %8s %8s %10s %8s %8s %5s\n",
+          "cpu", "tid", "queued", "load", "avg", "switches", "steals", "pulls", "tick");
+
+    // Unlocked, every column is only as fresh as the moment it was read
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        struct runqueue_t* rq = &runqueues[i];
+        struct thread_t* curr = READ_ONCE(rq->curr);
+
+        TRACE("\t%-4lu %-6lu %6lu %8lu %8lu %10lu %8lu %8lu %5s\n",
+              i,
+              curr != &rq->idle ? curr->tid : 0,
+              rq->queued,
+              rq->load,
+              rq->load_avg,
+              rq->switches,
+              rq->steals,
+              rq->pulls,
+              rq->nohz ? "off" : "on");
+    }
+}
+
+// Run on every CPU by smp_run, the APs get their timer here
+static void scheduler_start(void* arg) {
+    (void)arg;
+
+    struct runqueue_t* rq = this_rq();
+
+    rq->cpu = smp_cpu_id();
+    rq->ticks = rq->cpu;
+    rq->tree.root = NULL;
+    rq->tree.node_size = sizeof(struct thread_t);
+
+    // Whatever called us becomes the idle thread, its registers get saved on the first switch
+    rq->idle.cpu = rq->cpu;
+    rq->idle.state = T_STATE_RUNNING;
+    rq->idle.on_rq = 1;
+    rq->idle.pinned = 1;
+    WRITE_ONCE(rq->curr, &rq->idle);
+
+    if (rq->cpu)
+        lapic_timer_start();
+}
 
 void init_scheduler() {
-    root = kmalloc(sizeof(struct rb_root_t));
+    process_cache = kmem_cache_create("process_t", sizeof(struct process_t), CACHE_LINE_SIZE, NULL);
+    thread_cache = kmem_cache_create("thread_t", sizeof(struct thread_t), CACHE_LINE_SIZE, NULL);
+
+    vec_n(&processes);
+
+    scheduler_calibrate();
+
+    uint32_t eax, ebx, ecx, edx;
+    sched_mwait = cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (ecx & CPUID_1_ECX_MONITOR);
+
+    // Every queue is up before any tick can look at one
+    smp_run(scheduler_start, NULL);
+
+    // The owner of kernel threads
+    task_pcreate();
+
+    register_handler(FPU_TRAP_VECTOR, task_fpu_trap);
+    register_handler(TIMER_VECTOR, task_tick);
+    register_handler(TASK_WAKE_VECTOR, task_resched);
+    register_handler(TASK_YIELD_VECTOR, schedule);
 
-    pid_bitmap = kmalloc(sizeof(struct bitmap_t));
-    tid_bitmap = kmalloc(sizeof(struct bitmap_t));
+    serial_register_cmd("sched", sched_cmd);
 
-    bitmap_n(pid_bitmap, 1);
-    bitmap_n(tid_bitmap, 1);
+    TRACE("CFS on %lu CPUs, %lu us latency, %lu us minimum slice, idle with %s\n",
+          smp_cpu_count, (size_t)SCHED_LATENCY_US, (size_t)SCHED_MIN_GRAN_US,
+          sched_mwait ? "mwait" : "hlt");
 }
@@ -3,21 +3,64 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <locks.h>
 #include <proc/regs.h>
+#include <sys/percpu.h>
+
+/* Raised on a CPU when a thread woken for it should run before what it is running, unless it MWAITs */
+#define TASK_WAKE_VECTOR    48
+/* Raised by a thread on itself to give up the CPU the way preemption does, task_yield is quicker */
+#define TASK_YIELD_VECTOR   49
+
+/* task_tcreate_on lets the scheduler pick, and move the thread later */
+#define TASK_CPU_ANY        ((size_t)-1)
+
+#define TASK_NICE_MIN       -20
+#define TASK_NICE_MAX       19
 
 typedef size_t tid_t;
 typedef size_t pid_t;
 
-tid_t task_tcreate(pid_t ppid);
+struct thread_t;
+
+tid_t task_tcreate(pid_t ppid, void (*entry)(void*), void* arg);
+tid_t task_tcreate_on(pid_t ppid, void (*entry)(void*), void* arg, size_t cpu);
 pid_t task_pcreate();
 int task_tkill(pid_t ppid, tid_t tid);
 int task_tpause(pid_t pid, tid_t tid);
 int task_tresume(pid_t pid, tid_t tid);
+int task_tnice(pid_t pid, tid_t tid, int nice);
+size_t task_weight(int nice);
 
 int kill(pid_t pid, int exit);
 
+__attribute__((noreturn))
+void task_exit();
+
+struct thread_t* task_self();
+int task_running(struct thread_t* thread);
+void task_block(spinlock_t* lock);
+void task_wake(struct thread_t* thread);
+void task_yield();
+int task_idle();
+void task_halt();
+uint64_t task_clock_ms();
+
 void schedule(struct regs_t* regs);
 
 void init_scheduler();
 
+/**
+ * Nothing is switched out on this CPU while preempt is nonzero. Every
+ * spinlock_t and mcs_lock_t holds it up as well, taking and releasing
+ * one counts in asm/locks.asm.
+ */
+static inline void preempt_disable() {
+    this_cpu_inc(preempt);
+}
+
+static inline void preempt_enable() {
+    this_cpu_dec(preempt);
+}
+
 #endif
@@ -0,0 +1,98 @@
+#include <proc/wait.h>
+#include <sys/interrupts.h>
+
+// Returns with wq->lock held and interrupts off, the condition is tested under it
+void wait_prepare(struct wait_queue_t* wq, struct wait_entry_t* entry) {
+    entry->next = NULL;
+    entry->thread = task_self();
+    entry->woken = 0;
+
+    entry->flags = irq_save();
+    spinlock_lock(&wq->lock);
+
+    if (wq->tail)
+        wq->tail->next = entry;
+    else
+        WRITE_ONCE(wq->head, entry);
+
+    wq->tail = entry;
+
+    // Pairs with the waker's store to its condition, see wait_queue_active
+    smp_mb();
+}
+
+static void wait_unlink(struct wait_queue_t* wq, struct wait_entry_t* entry) {
+    struct wait_entry_t* prev = NULL;
+
+    for (struct wait_entry_t* cur = wq->head; cur; prev = cur, cur = cur->next) {
+        if (cur != entry)
+            continue;
+
+        if (prev)
+            prev->next = cur->next;
+        else
+            WRITE_ONCE(wq->head, cur->next);
+
+        if (wq->tail == cur)
+            wq->tail = prev;
+
+        return;
+    }
+}
+
+void wait_cancel(struct wait_queue_t* wq, struct wait_entry_t* entry) {
+    wait_unlink(wq, entry);
+
+    spinlock_release(&wq->lock);
+    irq_restore(entry->flags);
+}
+
+void wait_sleep(struct wait_queue_t* wq, struct wait_entry_t* entry) {
+    if (entry->thread) {
+        task_block(&wq->lock);
+        irq_restore(entry->flags);
+        return;
+    }
+
+    spinlock_release(&wq->lock);
+    irq_restore(entry->flags);
+
+    while (!READ_ONCE(entry->woken))
+        cpu_relax();
+}
+
+static size_t wake(struct wait_queue_t* wq, size_t n) {
+    size_t woken = 0;
+    size_t flags = irq_save();
+    spinlock_lock(&wq->lock);
+
+    while (wq->head && woken < n) {
+        struct wait_entry_t* entry = wq->head;
+        struct thread_t* thread = entry->thread;
+
+        WRITE_ONCE(wq->head, entry->next);
+        if (!wq->head)
+            wq->tail = NULL;
+
+        // Last touch of the entry, the waiter may return and reuse its stack right after
+        smp_store_release(&entry->woken, 1);
+
+        if (thread)
+            task_wake(thread);
+
+        woken++;
+    }
+
+    spinlock_release(&wq->lock);
+    irq_restore(flags);
+
+    return woken;
+}
+
+size_t wake_up(struct wait_queue_t* wq) {
+    return wake(wq, 1);
+}
+
+size_t wake_up_all(struct wait_queue_t* wq) {
+    return wake(wq, SIZE_MAX);
+}
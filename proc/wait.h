@@ -0,0 +1,66 @@
+#ifndef __PROC__WAIT_H__
+#define __PROC__WAIT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <locks.h>
+#include <atomic.h>
+#include <proc/task.h>
+
+/**
+ * THEORY
+ * ------
+ * A wait queue is a FIFO of entries that live on the waiters' stacks.
+ * wait_event queues the caller, then tests the condition with the
+ * queue's lock held, and only sleeps if it is still false. A waker
+ * changes the condition first and takes the same lock to wake, so it
+ * either runs before the test, which then passes, or finds the entry.
+ *
+ * The waker unlinks the entry before marking it woken and never touches
+ * it again, the waiter's stack frame may be gone the moment it is.
+ *
+ * Waiting sleeps through the scheduler when there is a thread to put to
+ * sleep. Boot code has none and spins on its entry instead. Waking is
+ * fine from interrupts, waiting obviously isn't.
+ */
+
+struct wait_entry_t {
+    struct wait_entry_t* next;
+    struct thread_t* thread;
+    volatile int woken;
+
+    size_t flags;
+};
+
+struct wait_queue_t {
+    spinlock_t lock;
+
+    struct wait_entry_t* head;
+    struct wait_entry_t* tail;
+};
+
+void wait_prepare(struct wait_queue_t* wq, struct wait_entry_t* entry);
+void wait_cancel(struct wait_queue_t* wq, struct wait_entry_t* entry);
+void wait_sleep(struct wait_queue_t* wq, struct wait_entry_t* entry);
+
+size_t wake_up(struct wait_queue_t* wq);
+size_t wake_up_all(struct wait_queue_t* wq);
+
+/* Whether anyone waits, a hint unless the caller orders it against its own stores */
+static inline int wait_queue_active(struct wait_queue_t* wq) {
+    return READ_ONCE(wq->head) != NULL;
+}
+
+#define wait_event(wq, cond) do { \
+    struct wait_entry_t __entry; \
+    for (;;) { \
+        wait_prepare(wq, &__entry); \
+        if (cond) { \
+            wait_cancel(wq, &__entry); \
+            break; \
+        } \
+        wait_sleep(wq, &__entry); \
+    } \
+} while (0)
+
+#endif
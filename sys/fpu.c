@@ -0,0 +1,167 @@
+#include <sys/fpu.h>
+#include <sys/cpuid.h>
+#include <slab.h>
+#include <mem.h>
+#include <trace.h>
+
+#undef __MODULE__
+#define __MODULE__ "fpu"
+
+#define CR0_MP              (1ul << 1)
+#define CR0_EM              (1ul << 2)
+#define CR0_TS              (1ul << 3)
+
+#define CR4_OSFXSR          (1ul << 9)
+#define CR4_OSXMMEXCPT      (1ul << 10)
+#define CR4_OSXSAVE         (1ul << 18)
+
+#define CPUID_1_ECX_XSAVE   (1u << 26)
+#define CPUID_D1_EAX_XSAVEOPT (1u << 0)
+
+// x87, SSE, AVX and the three AVX-512 parts, the ones that need nothing else turned on
+#define XCR0_USER           0xE7ull
+
+#define FXSAVE_SIZE         512
+#define FXSAVE_FCW          0
+#define FXSAVE_MXCSR        24
+
+#define FCW_INIT            0x037F
+#define MXCSR_INIT          0x1F80
+
+enum fpu_mode_t {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+};
+
+static enum fpu_mode_t fpu_mode;
+static uint64_t fpu_xcr0;
+static size_t fpu_size = FXSAVE_SIZE;
+
+static struct kmem_cache_t* fpu_cache;
+
+static const char* fpu_modes[] = {
+    [FPU_FXSAVE] = "fxsave",
+    [FPU_XSAVE] = "xsave",
+    [FPU_XSAVEOPT] = "xsaveopt",
+};
+
+static uint64_t read_cr0() {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static void write_cr0(uint64_t cr0) {
+    asm volatile("mov %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+static uint64_t read_cr4() {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static void write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+static void xsetbv(uint32_t reg, uint64_t val) {
+    asm volatile("xsetbv" :: "c"(reg), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+void* fpu_alloc() {
+    uint8_t* area = kmem_cache_alloc(fpu_cache);
+
+    if (!area)
+        return NULL;
+
+    // A zero XSAVE header has every component in its init state, only MXCSR is loaded regardless
+    memset(area, 0, fpu_size);
+    *(uint16_t *)(area + FXSAVE_FCW) = FCW_INIT;
+    *(uint32_t *)(area + FXSAVE_MXCSR) = MXCSR_INIT;
+
+    return area;
+}
+
+void fpu_free(void* area) {
+    if (area)
+        kmem_cache_free(fpu_cache, area);
+}
+
+void fpu_save(void* area) {
+    uint32_t lo = fpu_xcr0, hi = fpu_xcr0 >> 32;
+
+    switch (fpu_mode) {
+        case FPU_XSAVEOPT:
+            asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_XSAVE:
+            asm volatile("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+            break;
+        case FPU_FXSAVE:
+            asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+            break;
+    }
+}
+
+void fpu_restore(void* area) {
+    uint32_t lo = fpu_xcr0, hi = fpu_xcr0 >> 32;
+
+    if (fpu_mode == FPU_FXSAVE)
+        asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+    else
+        asm volatile("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+}
+
+void fpu_enable() {
+    asm volatile("clts" ::: "memory");
+}
+
+void fpu_disable() {
+    uint64_t cr0 = read_cr0();
+
+    // Writing CR0 serializes, and switches between threads that never use the FPU are the common case
+    if (!(cr0 & CR0_TS))
+        write_cr0(cr0 | CR0_TS);
+}
+
+// Every CPU, the BSP from init_fpu and the APs from ap_main
+void fpu_cpu_init() {
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+    if (fpu_mode != FPU_FXSAVE)
+        cr4 |= CR4_OSXSAVE;
+
+    write_cr4(cr4);
+
+    // Nothing may use the registers until the scheduler hands them to a thread
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+
+    if (fpu_mode != FPU_FXSAVE)
+        xsetbv(0, fpu_xcr0);
+}
+
+void init_fpu() {
+    uint32_t eax, ebx, ecx, edx;
+
+    if (cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (ecx & CPUID_1_ECX_XSAVE)
+            && cpuid(0xD, 0, &eax, &ebx, &ecx, &edx)) {
+        fpu_xcr0 = (((uint64_t)edx << 32) | eax) & XCR0_USER;
+        fpu_mode = FPU_XSAVE;
+
+        if (cpuid(0xD, 1, &eax, &ebx, &ecx, &edx) && (eax & CPUID_D1_EAX_XSAVEOPT))
+            fpu_mode = FPU_XSAVEOPT;
+    }
+
+    fpu_cpu_init();
+
+    // EBX is the size for what XCR0 has on now, not for everything the CPU could do
+    if (fpu_mode != FPU_FXSAVE && cpuid(0xD, 0, &eax, &ebx, &ecx, &edx))
+        fpu_size = ebx;
+
+    // XSAVE wants 64 byte alignment, FXSAVE 16
+    fpu_cache = kmem_cache_create("fpu", fpu_size, CACHE_LINE_SIZE, NULL);
+
+    TRACE("%s, %lu byte areas, xcr0 %#lx\n", fpu_modes[fpu_mode], fpu_size, fpu_xcr0);
+}
@@ -0,0 +1,42 @@
+#ifndef __SYS__FPU_H__
+#define __SYS__FPU_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * THEORY
+ * ------
+ * The kernel itself is built without SSE, so FPU and SIMD registers only
+ * ever hold some thread's state. Each thread that uses them gets an area
+ * from a cache of its own to keep that state in while it is switched
+ * out. The area is sized for every user component the CPU has (x87, SSE,
+ * AVX, AVX-512) by CPUID leaf 0xD once XCR0 enables them.
+ *
+ * Threads start with CR0.TS set and no area, so most of them never pay
+ * for any of this. The first FPU or SIMD instruction traps with #NM, and
+ * the scheduler gives the thread an area in the init state and marks it
+ * as an FPU user. From then on its state is saved and restored eagerly
+ * on every switch, which beats taking a trap each time.
+ *
+ * The save is XSAVEOPT where the CPU has it. It leaves out components
+ * still in their init state, and those left unchanged since the XRSTOR
+ * from the same area, which is most of AVX-512 for most threads. CPUs
+ * without XSAVE fall back to FXSAVE, the 512 byte x87 and SSE area.
+ */
+
+/* Hands out areas that restore to every component's init state */
+void* fpu_alloc();
+void fpu_free(void* area);
+
+void fpu_save(void* area);
+void fpu_restore(void* area);
+
+/* CR0.TS, clear while the running thread owns the registers */
+void fpu_enable();
+void fpu_disable();
+
+void fpu_cpu_init();
+void init_fpu();
+
+#endif
@@ -1,6 +1,8 @@
 #include <sys/interrupts.h>
 #include <sys/ports.h>
+#include <sys/percpu.h>
 #include <io.h>
+#include <rcu.h>
 
 struct idt_entry {
     uint16_t offset_lo;
@@ -38,7 +40,7 @@ static void set_entry(int idx, size_t handler) {
     idt[idx].offset_hi  = high;
 }
 
-static void load_idt() {
+void load_idt() {
     idtr.limit = IDT_ENTRIES * sizeof(struct idt_entry) - 1;
     idtr.base = (uint64_t)&idt;
 
@@ -88,9 +90,16 @@ void isr_handler(struct regs_t* regs) {
     #define __MODULE__ "err"
 
     if (regs->int_no >= 32) {
+        this_cpu_inc(irqs);
+        rcu_irq_enter();
+
         if (handlers[regs->int_no]) {
             handlers[regs->int_no](regs);
         }
+    } else if (handlers[regs->int_no]) {
+        // An exception something knows how to fix up, there is nothing to EOI
+        handlers[regs->int_no](regs);
+        return;
     } else {
         asm volatile("cli");
 
@@ -12,7 +12,22 @@
 #undef __MODULE__
 #define __MODULE__ "int"
 
+static inline size_t irq_save() {
+    size_t flags;
+    asm volatile("pushfq\n\t"
+                 "pop %0\n\t"
+                 "cli"
+                 : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(size_t flags) {
+    if (flags & (1 << 9))
+        asm volatile("sti" ::: "memory");
+}
+
 void register_handler(uint8_t int_no, void (*handler)(struct regs_t*));
+void load_idt();
 void init_isrs();
 
 #endif
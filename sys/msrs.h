@@ -7,4 +7,11 @@
 uint64_t rdmsr(uint64_t msr);
 void wrmsr(uint64_t msr, uint64_t data);
 
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
 #endif
@@ -0,0 +1,40 @@
+#include <sys/percpu.h>
+#include <sys/smp.h>
+#include <arena.h>
+#include <slab.h>
+#include <mem.h>
+
+struct percpu_t* percpu_areas[SMP_MAX_CPUS];
+
+// Nothing to allocate the BSP's area from that early, init_smp fills in its LAPIC ID
+static struct percpu_t percpu_bsp;
+
+struct percpu_t* percpu_alloc(size_t cpu, uint32_t lapic_id) {
+    struct percpu_t* area = arena_alloc_aligned(boot_arena, sizeof(struct percpu_t), CACHE_LINE_SIZE);
+
+    if (!area)
+        return NULL;
+
+    area = (struct percpu_t *)((uintptr_t)area + HIGH_VMA);
+    memset(area, 0, sizeof(struct percpu_t));
+    area->self = area;
+    area->cpu = cpu;
+    area->lapic_id = lapic_id;
+
+    percpu_areas[cpu] = area;
+
+    return area;
+}
+
+void percpu_load(struct percpu_t* area) {
+    wrmsr(IA32_GS_BASE, (uint64_t)area);
+    wrmsr(IA32_KERNEL_GS_BASE, (uint64_t)area);
+}
+
+void init_percpu() {
+    percpu_bsp.self = &percpu_bsp;
+    percpu_bsp.cpu = 0;
+
+    percpu_areas[0] = &percpu_bsp;
+    percpu_load(&percpu_bsp);
+}
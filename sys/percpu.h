@@ -0,0 +1,118 @@
+#ifndef __SYS__PERCPU_H__
+#define __SYS__PERCPU_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/msrs.h>
+
+#define IA32_GS_BASE            0xC0000101
+#define IA32_KERNEL_GS_BASE     0xC0000102
+
+/**
+ * THEORY
+ * ------
+ * Every CPU has a struct percpu_t of its own and IA32_GS_BASE points at
+ * it, so a field of the running CPU's area is one %gs: relative mov, add
+ * or inc away. No lookup of the CPU number first, no lock, and nothing
+ * another CPU writes shares its lines.
+ *
+ * The BSP starts on a static area loaded first thing in kmain, before
+ * anything can ask which CPU it is on. init_smp allocates one for every
+ * other CPU in the stivale2 SMP tag and hands it over in extra_argument,
+ * and ap_main loads it before doing anything else.
+ *
+ * The this_cpu_* accessors are only atomic against interrupts on the same
+ * CPU (a single instruction can't be split by one), not against other
+ * CPUs, which is all CPU-local data needs. They work on integer and
+ * pointer fields of 1, 2, 4 or 8 bytes. Take this_cpu() and go through the
+ * pointer for anything bigger.
+ *
+ * Reloading %gs with a selector loads its base from the GDT and loses
+ * the area, so nothing may touch %gs after init_percpu. KERNEL_GS_BASE
+ * holds the area too, for the swapgs on the way in from userspace.
+ */
+
+struct thread_t;
+
+struct percpu_t {
+    struct percpu_t* self;
+
+    size_t cpu;
+    uint32_t lapic_id;
+
+    struct thread_t* thread;
+    size_t preempt;
+
+    size_t irqs;
+} __attribute__((aligned(64)));
+
+#define PERCPU_OFF(field)   __builtin_offsetof(struct percpu_t, field)
+
+/* asm/locks.asm counts held locks in preempt without the struct to go by */
+#define PERCPU_PREEMPT      32
+
+_Static_assert(PERCPU_OFF(preempt) == PERCPU_PREEMPT, "asm/locks.asm has the wrong preempt offset");
+
+#define __percpu_type(field) __typeof__(((struct percpu_t *)0)->field)
+
+#define this_cpu_read(field) __extension__ ({ \
+    union { __percpu_type(field) v; uint8_t b; uint16_t w; uint32_t l; uint64_t q; } __u; \
+    switch (sizeof(__u.v)) { \
+        case 1: asm volatile("movb %%gs:%c1, %0" : "=q"(__u.b) : "i"(PERCPU_OFF(field))); break; \
+        case 2: asm volatile("movw %%gs:%c1, %0" : "=r"(__u.w) : "i"(PERCPU_OFF(field))); break; \
+        case 4: asm volatile("movl %%gs:%c1, %0" : "=r"(__u.l) : "i"(PERCPU_OFF(field))); break; \
+        case 8: asm volatile("movq %%gs:%c1, %0" : "=r"(__u.q) : "i"(PERCPU_OFF(field))); break; \
+    } \
+    __u.v; \
+})
+
+#define this_cpu_write(field, val) do { \
+    union { __percpu_type(field) v; uint8_t b; uint16_t w; uint32_t l; uint64_t q; } __u = { .v = (val) }; \
+    switch (sizeof(__u.v)) { \
+        case 1: asm volatile("movb %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "qi"(__u.b) : "memory"); break; \
+        case 2: asm volatile("movw %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "ri"(__u.w) : "memory"); break; \
+        case 4: asm volatile("movl %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "ri"(__u.l) : "memory"); break; \
+        case 8: asm volatile("movq %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "re"(__u.q) : "memory"); break; \
+    } \
+} while (0)
+
+#define this_cpu_add(field, val) do { \
+    union { __percpu_type(field) v; uint8_t b; uint16_t w; uint32_t l; uint64_t q; } __u = { .v = (val) }; \
+    switch (sizeof(__u.v)) { \
+        case 1: asm volatile("addb %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "qi"(__u.b) : "memory", "cc"); break; \
+        case 2: asm volatile("addw %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "ri"(__u.w) : "memory", "cc"); break; \
+        case 4: asm volatile("addl %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "ri"(__u.l) : "memory", "cc"); break; \
+        case 8: asm volatile("addq %1, %%gs:%c0" :: "i"(PERCPU_OFF(field)), "re"(__u.q) : "memory", "cc"); break; \
+    } \
+} while (0)
+
+#define this_cpu_inc(field) do { \
+    switch (sizeof(__percpu_type(field))) { \
+        case 1: asm volatile("incb %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+        case 2: asm volatile("incw %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+        case 4: asm volatile("incl %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+        case 8: asm volatile("incq %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+    } \
+} while (0)
+
+#define this_cpu_dec(field) do { \
+    switch (sizeof(__percpu_type(field))) { \
+        case 1: asm volatile("decb %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+        case 2: asm volatile("decw %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+        case 4: asm volatile("decl %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+        case 8: asm volatile("decq %%gs:%c0" :: "i"(PERCPU_OFF(field)) : "memory", "cc"); break; \
+    } \
+} while (0)
+
+/* The running CPU's area, for fields the accessors can't handle */
+#define this_cpu()  this_cpu_read(self)
+
+/* Any CPU's area by number, NULL until it has one */
+extern struct percpu_t* percpu_areas[];
+
+struct percpu_t* percpu_alloc(size_t cpu, uint32_t lapic_id);
+void percpu_load(struct percpu_t* area);
+
+void init_percpu();
+
+#endif
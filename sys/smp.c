@@ -1,4 +1,69 @@
 #include <sys/smp.h>
+#include <sys/interrupts.h>
+#include <rcu.h>
+#include <proc/task.h>
+#include <sys/fpu.h>
+
+size_t smp_cpu_count = 1;
+
+static uint32_t cpu_to_lapic[SMP_MAX_CPUS];
+
+static volatile size_t smp_online;
+
+static void (*volatile smp_work)(void*);
+static void* volatile smp_work_arg;
+static volatile size_t smp_work_gen;
+static volatile size_t smp_work_done;
+
+// ap is a CPU number, not a LAPIC ID
+void send_ipi(uint8_t ap, uint32_t ipi) {
+    x2apic_write(LAPIC_REG_ICR0, ((uint64_t)cpu_to_lapic[ap] << 32) | ipi);
+}
+
+void smp_run(void (*fn)(void*), void* arg) {
+    smp_work = fn;
+    smp_work_arg = arg;
+    smp_work_done = 0;
+
+    __atomic_add_fetch(&smp_work_gen, 1, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 1; i < smp_cpu_count; i++)
+        send_ipi(i, SMP_RUN_VECTOR);
+
+    fn(arg);
+
+    while (__atomic_load_n(&smp_work_done, __ATOMIC_ACQUIRE) != smp_online)
+        asm volatile("pause");
+}
+
+static void ap_main(struct stivale2_smp_info* info) {
+    percpu_load((struct percpu_t *)info->extra_argument);
+    load_idt();
+    x2apic_enable();
+    fpu_cpu_init();
+
+    size_t gen = __atomic_load_n(&smp_work_gen, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&smp_online, 1, __ATOMIC_SEQ_CST);
+
+    // The idle thread, with interrupts off except while halted
+    for (;;) {
+        if (__atomic_load_n(&smp_work_gen, __ATOMIC_ACQUIRE) != gen) {
+            gen = smp_work_gen;
+            smp_work(smp_work_arg);
+
+            __atomic_add_fetch(&smp_work_done, 1, __ATOMIC_RELEASE);
+        }
+
+        // Idle APs are quiescent, keep grace periods moving
+        rcu_qs();
+
+        // Without a timer yet only smp_run would wake it, so spin until the scheduler starts one
+        if (task_idle())
+            task_halt();
+        else
+            asm volatile("pause");
+    }
+}
 
 void init_smp(struct stivale2_struct_tag_smp* smp) {
     TRACE("Parsing SMP Information\n");
@@ -8,15 +73,58 @@ void init_smp(struct stivale2_struct_tag_smp* smp) {
             "Stack",
             "Addr");
 
-    for (uint64_t i = 0; i < smp->cpu_count; i++) {
+    uint32_t bsp_lapic_id = x2apic_read(LAPIC_REG_ID);
+    size_t cpus = smp->cpu_count < SMP_MAX_CPUS ? smp->cpu_count : SMP_MAX_CPUS;
+
+    // The BSP keeps CPU 0, it has been that since boot
+    size_t next_ap = 1;
+
+    for (uint64_t i = 0; i < cpus; i++) {
         struct stivale2_smp_info* smp_info = &(smp->smp_info[i]);
+        size_t cpu = smp_info->lapic_id == bsp_lapic_id ? 0 : next_ap;
+
+        if (smp_info->lapic_id == bsp_lapic_id) {
+            percpu_areas[0]->lapic_id = bsp_lapic_id;
+        } else {
+            struct percpu_t* area = percpu_alloc(cpu, smp_info->lapic_id);
+            uint8_t* stack = arena_alloc_aligned(boot_arena, SMP_AP_STACK_SIZE, PAGESIZE);
+
+            // Left parked, the next AP takes its number so CPU numbers stay dense
+            if (!area || !stack) {
+                ERR("No memory for LAPIC %u, leaving it offline\n", smp_info->lapic_id);
+                smp_info->extra_argument = 0;
+                percpu_areas[cpu] = NULL;
+                continue;
+            }
+
+            smp_info->extra_argument = (uint64_t)area;
+            smp_info->target_stack = (uint64_t)(stack + SMP_AP_STACK_SIZE + HIGH_VMA);
+            next_ap++;
+        }
 
-        smp_info->target_stack = (uint64_t)kmalloc(0x1000) + HIGH_VMA;
+        cpu_to_lapic[cpu] = smp_info->lapic_id;
 
         TRACE("\t%-10lu %-10lu %#-18lx %#-18lx\n",
-                smp_info->processor_id,
+                cpu,
                 smp_info->lapic_id,
                 smp_info->target_stack,
                 smp_info->goto_address);
     }
+
+    smp_cpu_count = next_ap;
+
+    // Release the APs, they park in ap_main waiting for smp_run work
+    for (uint64_t i = 0; i < cpus; i++) {
+        struct stivale2_smp_info* smp_info = &(smp->smp_info[i]);
+
+        if (smp_info->lapic_id == bsp_lapic_id || !smp_info->extra_argument)
+            continue;
+
+        __atomic_store_n(&smp_info->goto_address, (uint64_t)ap_main, __ATOMIC_SEQ_CST);
+    }
+
+    while (__atomic_load_n(&smp_online, __ATOMIC_ACQUIRE) != next_ap - 1)
+        asm volatile("pause");
+
+    TRACE("%lu CPUs online\n", next_ap);
 }
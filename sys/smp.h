@@ -4,14 +4,31 @@
 #include <stdint.h>
 #include <trace.h>
 #include <alloc.h>
+#include <arena.h>
 #include <mem.h>
 #include <boot/stivale2.h>
 #include <drivers/apic.h>
+#include <sys/percpu.h>
 
 #undef __MODULE__
 #define __MODULE__ "smp"
 
+#define SMP_MAX_CPUS        64
+#define SMP_AP_STACK_SIZE   0x1000
+
+/* Wakes a halted AP to pick up smp_run work, there is no handler behind it */
+#define SMP_RUN_VECTOR      50
+
+extern size_t smp_cpu_count;
+
+static inline size_t smp_cpu_id() {
+    return this_cpu_read(cpu);
+}
+
+/* Runs fn on every CPU, the APs run it from their idle loops once nothing else is running there */
+void smp_run(void (*fn)(void*), void* arg);
+
 void send_ipi(uint8_t ap, uint32_t ipi);
-void init_smp();
+void init_smp(struct stivale2_struct_tag_smp* smp);
 
 #endif
@@ -0,0 +1,587 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <lib/alloc.h>
+#include <slab.h>
+#include <sys/smp.h>
+
+/*
+ * Host side driver for the kernel heap. Every workload runs in a
+ * forked child so it starts from an empty heap, and reports
+ *
+ *   ops/s      mallocs plus frees per second over all threads
+ *   p50/p99    latency of a sample of single operations, in ns
+ *   live       most bytes the workload held at once
+ *   held       most bytes the heap took from the pmm, not counting
+ *              the slab page map
+ *   frag       1 - live / held, metadata and fragmentation together
+ *   kept       bytes still taken from the pmm after everything is freed
+ *              and the heap was trimmed the way the idle loop does it
+ */
+
+#define ARENA_SIZE      (4ull << 30)
+#define LAT_EVERY       64
+#define SAMPLE_EVERY    4096
+#define BATCH           64
+#define RING_SIZE       1024
+
+#define LARSON_SLOTS    1000
+#define LARSON_ROUNDS   20
+
+enum dist_t {
+    DIST_SMALL,
+    DIST_MIXED,
+    DIST_LARGE,
+};
+
+static const char* dist_names[] = { "small", "mixed", "large" };
+
+struct block_t {
+    void* ptr;
+    size_t size;
+};
+
+struct worker_t {
+    pthread_t thread;
+    size_t id;
+    uint64_t rng;
+
+    size_t ops;
+    long live;
+
+    uint64_t* lat;
+    size_t lat_cnt;
+    size_t lat_max;
+
+    struct block_t* slots;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Single producer single consumer ring for prodcons */
+struct ring_t {
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct block_t blocks[RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/* Shared stack of batches for xmalloc */
+struct batch_t {
+    struct batch_t* next;
+    struct block_t blocks[BATCH];
+};
+
+static size_t threads = 4;
+static size_t total_ops = 4000000;
+static enum dist_t dist = DIST_MIXED;
+static int verify;
+
+static struct worker_t* workers;
+static pthread_barrier_t barrier;
+static pthread_barrier_t work_barrier;
+
+static volatile int sampling;
+static size_t peak_live;
+static size_t peak_held;
+static size_t base_held;
+
+static struct ring_t* rings;
+
+static struct batch_t* batches;
+static spinlock_t batches_lock;
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rnd(struct worker_t* w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static size_t rnd_size(struct worker_t* w) {
+    uint64_t r = rnd(w);
+
+    switch (dist) {
+        case DIST_SMALL:
+            return 8 + r % 249;
+        case DIST_LARGE:
+            return 4096 + r % (60 * 1024 + 1);
+        default:
+            // roughly what the kernel asks for: mostly small structures,
+            // some buffers, the odd multi page table
+            switch ((r >> 32) % 20) {
+                case 0:
+                    return 1025 + r % 15360;
+                case 1 ... 5:
+                    return 129 + r % 896;
+                default:
+                    return 8 + r % 121;
+            }
+    }
+}
+
+static void sample(struct worker_t* w) {
+    if (w->id != 0 || !sampling)
+        return;
+
+    long live = 0;
+    for (size_t i = 0; i < threads; i++)
+        live += __atomic_load_n(&workers[i].live, __ATOMIC_RELAXED);
+
+    size_t held = (pmm_used() - base_held) * PAGESIZE;
+
+    if (live > 0 && (size_t)live > peak_live)
+        peak_live = live;
+    if (held > peak_held)
+        peak_held = held;
+}
+
+static void fill(void* ptr, size_t size) {
+    memset(ptr, (uint8_t)size, size);
+}
+
+/* Blocks are filled with their size, so check against the size they were filled at */
+static void check(void* ptr, size_t len, size_t size) {
+    uint8_t* p = ptr;
+
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != (uint8_t)size) {
+            fprintf(stderr, "block %p (%zu bytes) corrupted at +%zu\n", ptr, size, i);
+            abort();
+        }
+    }
+}
+
+static void* op_malloc(struct worker_t* w, size_t size) {
+    int timed = !(w->ops % LAT_EVERY) && w->lat_cnt < w->lat_max;
+    uint64_t start = timed ? now() : 0;
+
+    void* p = kmalloc(size);
+
+    if (timed)
+        w->lat[w->lat_cnt++] = now() - start;
+
+    if (!p) {
+        fprintf(stderr, "kmalloc(%zu) failed\n", size);
+        abort();
+    }
+
+    // liballoc and every slab class align to 16
+    if ((uintptr_t)p & 15) {
+        fprintf(stderr, "kmalloc(%zu) returned misaligned %p\n", size, p);
+        abort();
+    }
+
+    if (verify)
+        fill(p, size);
+
+    __atomic_store_n(&w->live, w->live + size, __ATOMIC_RELAXED);
+    if (!(++w->ops % SAMPLE_EVERY))
+        sample(w);
+
+    return p;
+}
+
+static void op_free(struct worker_t* w, void* ptr, size_t size) {
+    if (verify)
+        check(ptr, size, size);
+
+    int timed = !(w->ops % LAT_EVERY) && w->lat_cnt < w->lat_max;
+    uint64_t start = timed ? now() : 0;
+
+    kfree(ptr);
+
+    if (timed)
+        w->lat[w->lat_cnt++] = now() - start;
+
+    __atomic_store_n(&w->live, w->live - size, __ATOMIC_RELAXED);
+    if (!(++w->ops % SAMPLE_EVERY))
+        sample(w);
+}
+
+/* Batches of allocations freed in order, on one thread */
+static void run_sizes(struct worker_t* w) {
+    struct block_t blocks[BATCH];
+    size_t ops = total_ops / threads;
+
+    while (w->ops < ops) {
+        for (size_t i = 0; i < BATCH; i++) {
+            blocks[i].size = rnd_size(w);
+            blocks[i].ptr = op_malloc(w, blocks[i].size);
+        }
+
+        for (size_t i = 0; i < BATCH; i++)
+            op_free(w, blocks[i].ptr, blocks[i].size);
+    }
+}
+
+/*
+ * Larson: random replacement in a slot array, and after every round
+ * each thread takes over its neighbour's array, so most frees hit
+ * memory another thread allocated.
+ */
+static void run_larson(struct worker_t* w) {
+    size_t per_round = total_ops / threads / LARSON_ROUNDS / 2;
+
+    for (size_t i = 0; i < LARSON_SLOTS; i++) {
+        w->slots[i].size = rnd_size(w);
+        w->slots[i].ptr = op_malloc(w, w->slots[i].size);
+    }
+
+    struct block_t* slots = w->slots;
+
+    for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+        for (size_t i = 0; i < per_round; i++) {
+            struct block_t* b = &slots[rnd(w) % LARSON_SLOTS];
+
+            op_free(w, b->ptr, b->size);
+            b->size = rnd_size(w);
+            b->ptr = op_malloc(w, b->size);
+        }
+
+        pthread_barrier_wait(&work_barrier);
+        slots = workers[(w->id + round + 1) % threads].slots;
+        pthread_barrier_wait(&work_barrier);
+    }
+
+    pthread_barrier_wait(&work_barrier);
+    sampling = 0;
+
+    for (size_t i = 0; i < LARSON_SLOTS; i++)
+        op_free(w, slots[i].ptr, slots[i].size);
+}
+
+/*
+ * xmalloc-test: every thread allocates a batch, publishes it, and
+ * frees whichever batch it picks up next, usually someone else's.
+ */
+static void run_xmalloc(struct worker_t* w) {
+    size_t ops = total_ops / threads;
+
+    while (w->ops < ops) {
+        struct batch_t* batch = kmalloc(sizeof(struct batch_t));
+
+        for (size_t i = 0; i < BATCH; i++) {
+            batch->blocks[i].size = rnd_size(w);
+            batch->blocks[i].ptr = op_malloc(w, batch->blocks[i].size);
+        }
+
+        // swap ours for whichever batch was published last
+        spinlock_lock(&batches_lock);
+        struct batch_t* other = batches;
+        if (other)
+            batches = other->next;
+        batch->next = batches;
+        batches = batch;
+        spinlock_release(&batches_lock);
+
+        if (!other)
+            continue;
+
+        batch = other;
+        for (size_t i = 0; i < BATCH; i++)
+            op_free(w, batch->blocks[i].ptr, batch->blocks[i].size);
+
+        kfree(batch);
+    }
+
+    pthread_barrier_wait(&work_barrier);
+    sampling = 0;
+
+    if (w->id == 0) {
+        while (batches) {
+            struct batch_t* batch = batches;
+            batches = batch->next;
+
+            for (size_t i = 0; i < BATCH; i++)
+                op_free(w, batch->blocks[i].ptr, batch->blocks[i].size);
+
+            kfree(batch);
+        }
+    }
+}
+
+/*
+ * Random slots resized with krealloc, sizes drifting up and down so
+ * both in-place growth and shrinking get hit. With -v the surviving
+ * prefix is checked after every move.
+ */
+static void run_realloc(struct worker_t* w) {
+    size_t ops = total_ops / threads;
+
+    for (size_t i = 0; i < LARSON_SLOTS; i++) {
+        w->slots[i].size = rnd_size(w);
+        w->slots[i].ptr = op_malloc(w, w->slots[i].size);
+    }
+
+    while (w->ops < ops) {
+        struct block_t* b = &w->slots[rnd(w) % LARSON_SLOTS];
+        uint64_t r = rnd(w);
+        size_t size = r & 1 ? b->size + b->size / 2 + 1 : b->size / 2 + 1;
+
+        if (size > 16 * 1024 * 1024)
+            size = rnd_size(w);
+
+        int timed = !(w->ops % LAT_EVERY) && w->lat_cnt < w->lat_max;
+        uint64_t start = timed ? now() : 0;
+
+        void* p = krealloc(b->ptr, size);
+
+        if (timed)
+            w->lat[w->lat_cnt++] = now() - start;
+
+        if (!p) {
+            fprintf(stderr, "krealloc(%zu) failed\n", size);
+            abort();
+        }
+
+        if (kmalloc_usable_size(p) < size) {
+            fprintf(stderr, "krealloc(%zu) returned %p with only %zu usable\n", size, p, kmalloc_usable_size(p));
+            abort();
+        }
+
+        if (verify) {
+            check(p, size < b->size ? size : b->size, b->size);
+            fill(p, size);
+        }
+
+        __atomic_store_n(&w->live, w->live + size - b->size, __ATOMIC_RELAXED);
+        b->ptr = p;
+        b->size = size;
+
+        if (!(++w->ops % SAMPLE_EVERY))
+            sample(w);
+    }
+
+    pthread_barrier_wait(&work_barrier);
+    sampling = 0;
+
+    for (size_t i = 0; i < LARSON_SLOTS; i++)
+        op_free(w, w->slots[i].ptr, w->slots[i].size);
+}
+
+/* Even threads allocate into a ring, the odd one next to them frees it */
+static void run_prodcons(struct worker_t* w) {
+    struct ring_t* ring = &rings[w->id / 2];
+    size_t ops = total_ops / threads;
+
+    if (w->id % 2 == 0 && w->id + 1 < threads) {
+        for (size_t n = 0; n < ops; n++) {
+            size_t head = ring->head;
+            while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+                __builtin_ia32_pause();
+
+            struct block_t* b = &ring->blocks[head % RING_SIZE];
+            b->size = rnd_size(w);
+            b->ptr = op_malloc(w, b->size);
+
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    } else if (w->id % 2 == 1) {
+        for (size_t n = 0; n < ops; n++) {
+            size_t tail = ring->tail;
+            while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+                __builtin_ia32_pause();
+
+            struct block_t* b = &ring->blocks[tail % RING_SIZE];
+            op_free(w, b->ptr, b->size);
+
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+struct workload_t {
+    const char* name;
+    void (*run)(struct worker_t* w);
+};
+
+static const struct workload_t workloads[] = {
+    { "sizes",    run_sizes },
+    { "larson",   run_larson },
+    { "xmalloc",  run_xmalloc },
+    { "prodcons", run_prodcons },
+    { "realloc",  run_realloc },
+};
+
+static const struct workload_t* workload;
+
+static void* worker_main(void* arg) {
+    struct worker_t* w = arg;
+
+    smp_set_cpu(w->id);
+
+    pthread_barrier_wait(&barrier);
+    workload->run(w);
+    pthread_barrier_wait(&barrier);
+
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void run(const struct workload_t* wl) {
+    workload = wl;
+
+    init_pmm(ARENA_SIZE);
+    init_slab();
+    base_held = pmm_used();
+
+    workers = aligned_alloc(CACHE_LINE_SIZE, threads * sizeof(struct worker_t));
+    rings = aligned_alloc(CACHE_LINE_SIZE, (threads / 2 + 1) * sizeof(struct ring_t));
+    memset(rings, 0, (threads / 2 + 1) * sizeof(struct ring_t));
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    pthread_barrier_init(&work_barrier, NULL, threads);
+    sampling = 1;
+
+    for (size_t i = 0; i < threads; i++) {
+        struct worker_t* w = &workers[i];
+
+        memset(w, 0, sizeof(*w));
+        w->id = i;
+        w->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        w->lat_max = total_ops / LAT_EVERY + 1;
+        w->lat = calloc(w->lat_max, sizeof(uint64_t));
+        w->slots = calloc(LARSON_SLOTS, sizeof(struct block_t));
+
+        pthread_create(&w->thread, NULL, worker_main, w);
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now();
+    pthread_barrier_wait(&barrier);
+    uint64_t elapsed = now() - start;
+
+    size_t ops = 0, lat_cnt = 0;
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        lat_cnt += workers[i].lat_cnt;
+    }
+
+    uint64_t* lat = malloc((lat_cnt + 1) * sizeof(uint64_t));
+    lat_cnt = 0;
+    for (size_t i = 0; i < threads; i++) {
+        memcpy(&lat[lat_cnt], workers[i].lat, workers[i].lat_cnt * sizeof(uint64_t));
+        lat_cnt += workers[i].lat_cnt;
+    }
+    qsort(lat, lat_cnt, sizeof(uint64_t), cmp_u64);
+
+    kmalloc_trim(kmalloc_retain);
+
+    double frag = peak_held ? 100.0 * (1.0 - (double)peak_live / peak_held) : 0;
+
+    printf("%-8s %-5s %3zu  %12.0f  %6lu  %6lu  %9.2f  %9.2f  %5.1f%%  %9.2f\n",
+           wl->name, dist_names[dist], threads,
+           ops / (elapsed / 1e9),
+           lat_cnt ? lat[lat_cnt / 2] : 0,
+           lat_cnt ? lat[lat_cnt * 99 / 100] : 0,
+           peak_live / 1048576.0,
+           peak_held / 1048576.0,
+           frag,
+           (pmm_used() - base_held) * PAGESIZE / 1048576.0);
+}
+
+static void usage(const char* self) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-n ops] [-d small|mixed|large] [-r KiB] [-v] [workload...]\n"
+            "workloads: sizes larson xmalloc prodcons realloc (all by default)\n"
+            "  -r  idle memory the final trim leaves the heap\n"
+            "  -v  fill every block and check it on free\n",
+            self);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:d:r:vh")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                total_ops = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                for (dist = 0; dist <= DIST_LARGE; dist++) {
+                    if (!strcmp(optarg, dist_names[dist]))
+                        break;
+                }
+
+                if (dist > DIST_LARGE)
+                    usage(argv[0]);
+                break;
+            case 'r':
+                kmalloc_retain = strtoul(optarg, NULL, 0) * 1024;
+                break;
+            case 'v':
+                verify = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (threads < 1 || threads > SMP_MAX_CPUS) {
+        fprintf(stderr, "threads must be within 1 - %d\n", SMP_MAX_CPUS);
+        return 1;
+    }
+
+    printf("%-8s %-5s %3s  %12s  %6s  %6s  %9s  %9s  %6s  %9s\n",
+           "workload", "dist", "thr", "ops/s", "p50ns", "p99ns",
+           "live MiB", "held MiB", "frag", "kept MiB");
+
+    int status = 0;
+    size_t cnt = sizeof(workloads) / sizeof(workloads[0]);
+
+    for (size_t i = 0; i < cnt; i++) {
+        int picked = optind == argc;
+
+        for (int j = optind; j < argc; j++) {
+            if (!strcmp(argv[j], workloads[i].name))
+                picked = 1;
+        }
+
+        if (!picked)
+            continue;
+
+        if (!strcmp(workloads[i].name, "prodcons") && threads < 2) {
+            printf("%-8s needs at least 2 threads\n", workloads[i].name);
+            continue;
+        }
+
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(&workloads[i]);
+            fflush(stdout);
+            _exit(0);
+        }
+
+        int wstatus;
+        waitpid(pid, &wstatus, 0);
+
+        if (WIFSIGNALED(wstatus)) {
+            printf("%-8s failed, %s\n", workloads[i].name, strsignal(WTERMSIG(wstatus)));
+            status = 1;
+        } else if (WEXITSTATUS(wstatus)) {
+            printf("%-8s failed\n", workloads[i].name);
+            status = 1;
+        }
+    }
+
+    return status;
+}
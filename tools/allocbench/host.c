@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <mem.h>
+#include <locks.h>
+#include <mm/pmm.h>
+#include <sys/smp.h>
+
+/*
+ * The kernel services lib/alloc.c and lib/slab.c lean on, rebuilt on
+ * top of Linux. The pmm is a next-fit bitmap over one big
+ * MAP_NORESERVE mapping at PMM_BASE, everything below it is reserved
+ * the way low memory is in the kernel. Freed pages are given back
+ * with MADV_DONTNEED so RSS tracks what the heap really holds.
+ */
+
+#define PMM_BASE    0x40000000ull
+
+uint64_t totalmem;
+size_t smp_cpu_count = SMP_MAX_CPUS;
+
+static uint64_t* pmm_map;
+static size_t pmm_pages;
+static size_t pmm_next;
+static size_t pmm_inuse;
+static mcs_lock_t pmm_lock;
+
+static __thread size_t host_cpu;
+
+/*
+ * The same ticket and MCS locks as asm/locks.asm. Threads get preempted
+ * where CPUs don't, so a waiter yields now and then rather than spin
+ * out its time slice behind a holder that isn't running.
+ */
+static void host_relax(size_t* spins) {
+    if (++*spins % 64)
+        __builtin_ia32_pause();
+    else
+        sched_yield();
+}
+
+void spinlock_lock(spinlock_t* spinlock) {
+    volatile uint32_t* half = (volatile uint32_t *)spinlock;
+    uint32_t ticket = __atomic_fetch_add(&half[0], 1, __ATOMIC_ACQUIRE);
+    size_t spins = 0;
+
+    while (__atomic_load_n(&half[1], __ATOMIC_ACQUIRE) != ticket)
+        host_relax(&spins);
+}
+
+void spinlock_release(spinlock_t* spinlock) {
+    volatile uint32_t* half = (volatile uint32_t *)spinlock;
+    __atomic_store_n(&half[1], half[1] + 1, __ATOMIC_RELEASE);
+}
+
+void mcs_lock(mcs_lock_t* lock, struct mcs_node_t* node) {
+    size_t spins = 0;
+
+    node->next = NULL;
+    node->locked = 1;
+
+    struct mcs_node_t* prev = __atomic_exchange_n(lock, node, __ATOMIC_ACQ_REL);
+
+    if (!prev)
+        return;
+
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+        host_relax(&spins);
+}
+
+void mcs_release(mcs_lock_t* lock, struct mcs_node_t* node) {
+    struct mcs_node_t* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    size_t spins = 0;
+
+    if (!next) {
+        struct mcs_node_t* expected = node;
+
+        if (__atomic_compare_exchange_n(lock, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            host_relax(&spins);
+    }
+
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+size_t smp_cpu_id() {
+    return host_cpu;
+}
+
+void smp_set_cpu(size_t cpu) {
+    host_cpu = cpu;
+}
+
+static int pmm_test(size_t page) {
+    return (pmm_map[page / 64] >> (page % 64)) & 1;
+}
+
+static void pmm_mark(size_t page, size_t pages, int used) {
+    for (size_t i = page; i < page + pages; i++) {
+        if (used)
+            pmm_map[i / 64] |= 1ull << (i % 64);
+        else
+            pmm_map[i / 64] &= ~(1ull << (i % 64));
+    }
+}
+
+static void* pmm_find(size_t pages, size_t align, size_t from, size_t to) {
+    size_t run = 0;
+
+    for (size_t i = from; i < to; i++) {
+        if (!run && i % align) {
+            continue;
+        }
+
+        if (pmm_test(i)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == pages) {
+            size_t first = i + 1 - pages;
+
+            pmm_mark(first, pages, 1);
+            pmm_next = i + 1;
+            pmm_inuse += pages;
+
+            return (void *)(first * PAGESIZE);
+        }
+    }
+
+    return NULL;
+}
+
+void* pmm_alloc_aligned(size_t pages, size_t align) {
+    struct mcs_node_t node;
+
+    mcs_lock(&pmm_lock, &node);
+
+    void* ret = pmm_find(pages, align, pmm_next, pmm_pages);
+    if (!ret)
+        ret = pmm_find(pages, align, PMM_BASE / PAGESIZE, pmm_pages);
+
+    mcs_release(&pmm_lock, &node);
+
+    return ret;
+}
+
+void* pmm_alloc(size_t pages) {
+    return pmm_alloc_aligned(pages, 1);
+}
+
+void pmm_free(void* ptr, size_t pages) {
+    size_t first = (uintptr_t)ptr / PAGESIZE;
+    struct mcs_node_t node;
+
+    madvise(ptr, pages * PAGESIZE, MADV_DONTNEED);
+
+    mcs_lock(&pmm_lock, &node);
+    pmm_mark(first, pages, 0);
+    pmm_inuse -= pages;
+    mcs_release(&pmm_lock, &node);
+}
+
+int pmm_claim(void* ptr, size_t pages) {
+    size_t first = (uintptr_t)ptr / PAGESIZE;
+    int ret = 0;
+    struct mcs_node_t node;
+
+    mcs_lock(&pmm_lock, &node);
+
+    if (first + pages <= pmm_pages) {
+        size_t i;
+        for (i = first; i < first + pages && !pmm_test(i); i++)
+            ;
+
+        if (i == first + pages) {
+            pmm_mark(first, pages, 1);
+            pmm_inuse += pages;
+            ret = 1;
+        }
+    }
+
+    mcs_release(&pmm_lock, &node);
+
+    return ret;
+}
+
+size_t pmm_used() {
+    return __atomic_load_n(&pmm_inuse, __ATOMIC_RELAXED);
+}
+
+void init_pmm(size_t bytes) {
+    void* arena = mmap((void *)PMM_BASE, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+                       -1, 0);
+
+    if (arena != (void *)PMM_BASE) {
+        fprintf(stderr, "unable to map the %zu MiB arena at %#llx\n", bytes >> 20, PMM_BASE);
+        exit(1);
+    }
+
+    totalmem = PMM_BASE + bytes;
+    pmm_pages = totalmem / PAGESIZE;
+    pmm_map = calloc((pmm_pages + 63) / 64, sizeof(uint64_t));
+
+    pmm_mark(0, PMM_BASE / PAGESIZE, 1);
+    pmm_next = PMM_BASE / PAGESIZE;
+}
@@ -0,0 +1,11 @@
+#ifndef __DRIVERS__SERIAL_H__
+#define __DRIVERS__SERIAL_H__
+
+/* There is no console to register commands with */
+static inline int serial_register_cmd(char* name, void (*handler)(char* args)) {
+    (void)name;
+    (void)handler;
+    return 0;
+}
+
+#endif
@@ -0,0 +1 @@
+#include <mem.h>
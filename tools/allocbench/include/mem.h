@@ -0,0 +1,19 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+/*
+ * Host stand-in for lib/mem.h. "Physical" memory is a single mapping
+ * at a fixed low address, so like in the kernel pmm pointers are their
+ * own physical address and index the slab page map directly.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <trace.h>
+#include <mm/pmm.h>
+
+#define HIGH_VMA        0xFFFF800000000000ull
+#define PAGESIZE        0x1000
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __MM__PMM_H__
+#define __MM__PMM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/mem.h>
+#include <locks.h>
+
+extern uint64_t totalmem;
+
+/* Pages of the host arena, returned with MADV_DONTNEED on free */
+void* pmm_alloc(size_t pages);
+void* pmm_alloc_aligned(size_t pages, size_t align);
+void pmm_free(void* ptr, size_t pages);
+int pmm_claim(void* ptr, size_t pages);
+
+/* Pages currently handed out */
+size_t pmm_used();
+
+void init_pmm(size_t bytes);
+
+#endif
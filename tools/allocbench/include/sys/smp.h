@@ -0,0 +1,19 @@
+#ifndef __SYS__SMP_H__
+#define __SYS__SMP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SMP_MAX_CPUS        64
+
+extern size_t smp_cpu_count;
+
+/*
+ * Every benchmark thread claims a CPU slot of its own, which keeps the
+ * per-CPU magazines single-owner just like interrupts-off does in the
+ * kernel.
+ */
+size_t smp_cpu_id();
+void smp_set_cpu(size_t cpu);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __DEBUG_H__
+#define __DEBUG_H__
+
+#include <stdio.h>
+
+#ifndef __MODULE__
+    #define __MODULE__ "slate"
+#endif
+
+#define PRN(stat, fmt, ...) \
+    fprintf(stderr, stat " %-5s: " fmt, __MODULE__, ## __VA_ARGS__)
+
+/* Keep the tables clean, warnings and errors still go to stderr */
+#define TRACE(fmt, ...)
+#define WARN(fmt, ...)  PRN("[-]", fmt, ## __VA_ARGS__)
+#define ERR(fmt, ...)   PRN("[!]", fmt, ## __VA_ARGS__)
+
+#endif
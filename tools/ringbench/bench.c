@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ring.h>
+
+/*
+ * Host side throughput of the kernel rings. Producers push numbered
+ * items, consumers pop them, and each ring kind reports
+ *
+ *   items/s    items through the ring per second, end to end
+ *   empty      share of dequeue calls that found nothing
+ *   full       share of enqueue calls that found no room
+ *
+ * "locked" is the same ring shape behind one pthread spinlock, what a
+ * lock-guarded container costs for comparison. Every run checks that
+ * every item came out exactly once, and for spsc that they came in order.
+ */
+
+#define MAX_THREADS     64
+#define BATCH_MAX       256
+
+enum kind_t {
+    KIND_SPSC,
+    KIND_MPMC,
+    KIND_LOCKED,
+};
+
+static const char* kind_names[] = { "spsc", "mpmc", "locked" };
+
+struct locked_ring_t {
+    pthread_spinlock_t lock;
+    void** slots;
+    size_t mask;
+    size_t head;
+    size_t tail;
+};
+
+struct worker_t {
+    pthread_t thread;
+    size_t id;
+
+    size_t calls;
+    size_t misses;
+    size_t items;
+    unsigned long long sum;
+    int bad;
+} __attribute__((aligned(64)));
+
+static size_t producers = 1;
+static size_t consumers = 1;
+static size_t items_per_producer = 10000000;
+static size_t batch = 1;
+static size_t ring_size = 1024;
+
+static enum kind_t kind;
+
+static struct spsc_ring_t spsc;
+static struct mpmc_ring_t mpmc;
+static struct locked_ring_t locked;
+
+static volatile size_t consumed;
+static volatile int go;
+
+static size_t locked_enqueue(struct locked_ring_t* ring, void** items, size_t n) {
+    pthread_spin_lock(&ring->lock);
+
+    size_t space = ring->mask + 1 - (ring->head - ring->tail);
+    if (n > space)
+        n = space;
+
+    for (size_t i = 0; i < n; i++)
+        ring->slots[(ring->head + i) & ring->mask] = items[i];
+
+    ring->head += n;
+
+    pthread_spin_unlock(&ring->lock);
+    return n;
+}
+
+static size_t locked_dequeue(struct locked_ring_t* ring, void** items, size_t n) {
+    pthread_spin_lock(&ring->lock);
+
+    size_t avail = ring->head - ring->tail;
+    if (n > avail)
+        n = avail;
+
+    for (size_t i = 0; i < n; i++)
+        items[i] = ring->slots[(ring->tail + i) & ring->mask];
+
+    ring->tail += n;
+
+    pthread_spin_unlock(&ring->lock);
+    return n;
+}
+
+static size_t enqueue(void** items, size_t n) {
+    switch (kind) {
+        case KIND_SPSC: return spsc_enqueue(&spsc, items, n);
+        case KIND_MPMC: return mpmc_enqueue(&mpmc, items, n);
+        default:        return locked_enqueue(&locked, items, n);
+    }
+}
+
+static size_t dequeue(void** items, size_t n) {
+    switch (kind) {
+        case KIND_SPSC: return spsc_dequeue(&spsc, items, n);
+        case KIND_MPMC: return mpmc_dequeue(&mpmc, items, n);
+        default:        return locked_dequeue(&locked, items, n);
+    }
+}
+
+// Items are the producer in the top bits and a count below, never 0
+static void* item(size_t producer, size_t i) {
+    return (void *)(((uintptr_t)producer << 40) | (i + 1));
+}
+
+static void* producer(void* arg) {
+    struct worker_t* w = arg;
+    void* items[BATCH_MAX];
+    size_t next = 0;
+
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        ;
+
+    while (next < items_per_producer) {
+        size_t n = items_per_producer - next < batch ? items_per_producer - next : batch;
+
+        for (size_t i = 0; i < n; i++)
+            items[i] = item(w->id, next + i);
+
+        size_t done = 0;
+
+        while (done < n) {
+            size_t k = enqueue(items + done, n - done);
+
+            w->calls++;
+
+            if (!k) {
+                w->misses++;
+                sched_yield();
+            }
+
+            done += k;
+        }
+
+        next += n;
+    }
+
+    w->items = next;
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    struct worker_t* w = arg;
+    void* items[BATCH_MAX];
+    size_t total = producers * items_per_producer;
+    size_t expect = 1;
+
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        ;
+
+    while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < total) {
+        size_t n = dequeue(items, batch);
+
+        w->calls++;
+
+        if (!n) {
+            w->misses++;
+            sched_yield();
+            continue;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t v = (uintptr_t)items[i];
+
+            // One producer and one consumer, so everything arrives in order
+            if (kind == KIND_SPSC && v != expect++)
+                w->bad = 1;
+
+            w->sum += v;
+        }
+
+        w->items += n;
+        __atomic_add_fetch(&consumed, n, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(enum kind_t k) {
+    static struct worker_t prods[MAX_THREADS], cons[MAX_THREADS];
+
+    kind = k;
+    consumed = 0;
+    go = 0;
+
+    void** slots = calloc(ring_size, sizeof(void *));
+    struct mpmc_cell_t* cells = calloc(ring_size, sizeof(struct mpmc_cell_t));
+
+    spsc_init(&spsc, slots, ring_size);
+    mpmc_init(&mpmc, cells, ring_size);
+
+    pthread_spin_init(&locked.lock, PTHREAD_PROCESS_PRIVATE);
+    locked.slots = slots;
+    locked.mask = ring_size - 1;
+    locked.head = locked.tail = 0;
+
+    memset(prods, 0, sizeof(prods));
+    memset(cons, 0, sizeof(cons));
+
+    for (size_t i = 0; i < producers; i++) {
+        prods[i].id = i;
+        pthread_create(&prods[i].thread, NULL, producer, &prods[i]);
+    }
+
+    for (size_t i = 0; i < consumers; i++) {
+        cons[i].id = i;
+        pthread_create(&cons[i].thread, NULL, consumer, &cons[i]);
+    }
+
+    double start = now();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+    size_t enq_calls = 0, enq_misses = 0, deq_calls = 0, deq_misses = 0;
+    unsigned long long sum = 0;
+    size_t items = 0;
+    int bad = 0;
+
+    for (size_t i = 0; i < producers; i++) {
+        pthread_join(prods[i].thread, NULL);
+        enq_calls += prods[i].calls;
+        enq_misses += prods[i].misses;
+    }
+
+    for (size_t i = 0; i < consumers; i++) {
+        pthread_join(cons[i].thread, NULL);
+        deq_calls += cons[i].calls;
+        deq_misses += cons[i].misses;
+        sum += cons[i].sum;
+        items += cons[i].items;
+        bad |= cons[i].bad;
+    }
+
+    double secs = now() - start;
+
+    // Every producer pushed (p << 40) + 1 ... (p << 40) + count
+    unsigned long long expect = 0;
+    for (size_t p = 0; p < producers; p++)
+        expect += ((unsigned long long)p << 40) * items_per_producer + items_per_producer * (items_per_producer + 1) / 2;
+
+    if (items != producers * items_per_producer || sum != expect)
+        bad = 1;
+
+    printf("%-8s %4zu %4zu %6zu %12.0f %7.1f%% %7.1f%%%s\n",
+           kind_names[k], producers, consumers, batch,
+           items / secs,
+           deq_calls ? 100.0 * deq_misses / deq_calls : 0,
+           enq_calls ? 100.0 * enq_misses / enq_calls : 0,
+           bad ? "  LOST OR DUPLICATED ITEMS" : "");
+
+    free(slots);
+    free(cells);
+
+    if (bad)
+        exit(1);
+}
+
+static void usage(const char* self) {
+    fprintf(stderr,
+            "usage: %s [-p producers] [-c consumers] [-n items] [-b batch] [-s size] [ring...]\n"
+            "rings: spsc mpmc locked (all that fit by default, spsc only with -p 1 -c 1)\n"
+            "  -n  items each producer pushes\n"
+            "  -s  ring size, a power of two\n",
+            self);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:c:n:b:s:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                producers = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                consumers = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                items_per_producer = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                ring_size = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (producers < 1 || consumers < 1 || producers > MAX_THREADS || consumers > MAX_THREADS) {
+        fprintf(stderr, "producers and consumers must be within 1 - %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    if (batch < 1 || batch > BATCH_MAX) {
+        fprintf(stderr, "batch must be within 1 - %d\n", BATCH_MAX);
+        return 1;
+    }
+
+    if (!ring_size || (ring_size & (ring_size - 1))) {
+        fprintf(stderr, "ring size must be a power of two\n");
+        return 1;
+    }
+
+    printf("%-8s %4s %4s %6s %12s %8s %8s\n", "ring", "prod", "cons", "batch", "items/s", "empty", "full");
+
+    int ran = 0;
+
+    for (int i = optind; i < argc; i++) {
+        enum kind_t k;
+
+        for (k = KIND_SPSC; k <= KIND_LOCKED; k++) {
+            if (!strcmp(argv[i], kind_names[k]))
+                break;
+        }
+
+        if (k > KIND_LOCKED || (k == KIND_SPSC && (producers > 1 || consumers > 1)))
+            usage(argv[0]);
+
+        run(k);
+        ran = 1;
+    }
+
+    if (!ran) {
+        for (enum kind_t k = KIND_SPSC; k <= KIND_LOCKED; k++) {
+            if (k == KIND_SPSC && (producers > 1 || consumers > 1))
+                continue;
+
+            run(k);
+        }
+    }
+
+    return 0;
+}